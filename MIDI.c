@@ -68,6 +68,164 @@
  * 		important to have just in case. I recommend disabling all sounds/parameters/automation/etc
  * 		whenever this function is called, as it is intended as a panic button.
  *
+ * 	The library keeps a record of which notes are held on each channel. Before MIDI_systemReset is
+ * 	called, and when a sender that uses Active Sensing (0xFE) goes quiet for more than 300ms (e.g.
+ * 	the cable was pulled), the library releases only those held notes: per channel it calls
+ * 	MIDI_noteOff for each held note, or MIDI_CC(123, 0) ("All Notes Off") once if that is shorter on
+ * 	the wire. You can trigger the same thing yourself with MIDI_allNotesOff(). #define
+ * 	MIDI_NOTE_TRACKING as 0 to drop the record (and its 272 bytes of RAM); MIDI_allNotesOff() then
+ * 	always uses CC 123.
+ *
+ * 	When a DMA error (or a line error the HAL aborts the reception on) stops the UART reception,
+ * 	the next MIDI_check starts it again by itself, keeping the parser state.
+ *
+ * 	If the UART has to be restarted (low-power mode, firmware swap), MIDI_init starts the
+ * 	parser from scratch and anything arriving under running status is dropped until the sender
+ * 	transmits a new status byte. To avoid that, save the parser with MIDI_saveState(&state) before
+ * 	stopping and call MIDI_restoreState(&state) right after MIDI_init. The MIDI_State struct only
+ * 	holds plain values, so it can live in backup SRAM or flash. It records its size, format version and
+ * 	the options that add state (MIDI_STATE_FEATURES), and a snapshot from a build where any of these
+ * 	differ is refused.
+ *
+ * 	For multitimbral designs where every channel drives its own part, #define MIDI_CHANNEL_HANDLERS
+ * 	as 1 and register handlers per channel and message class with MIDI_setHandler(channel, msg,
+ * 	handler, context), e.g. MIDI_setHandler(3, MIDI_MSG_NOTE_ON, part_noteOn, &parts[2]). A
+ * 	registered handler is called with its context pointer, the channel (0-15) and the two data bytes,
+ * 	and replaces the global callback for that channel and class; this also gives access to program
+ * 	change and aftertouch, which have no global callback. The table costs 8 bytes per entry (896
+ * 	bytes on a 32-bit MCU).
+ *
+ * 	To filter or re-route messages, #define MIDI_FILTER_RULES as 1, describe what you want as an
+ * 	array of MIDI_Rule (e.g. "channels 1-4, notes 36-60 -> channel 9" or "drop CC 0-31 on channel
+ * 	10"), compile it once with MIDI_compileRules(&table, rules, count) and activate it with
+ * 	MIDI_setFilter(&table). The rules are turned into lookup tables, so checking a message costs at
+ * 	most two table reads no matter how many rules there are. A new table can be compiled on the side
+ * 	and swapped in with MIDI_setFilter at any time.
+ *
+ * 	For keyboard splits and layers, #define MIDI_ZONES as 1 and set up to eight zones with
+ * 	MIDI_setZone(zone, &config, channel, note_lo, note_hi). Each zone plays on its own channel with its
+ * 	own transpose and velocity scaling; overlapping key ranges make layers. Zones are looked up
+ * 	through a 128-entry table per input channel (2KB of RAM), so a note costs one table read however
+ * 	many zones there are. Controllers, pitchbend and other non-note messages of an input channel go to
+ * 	every zone that channel feeds. Zoned notes reach the callbacks/handlers on the zone's channel.
+ *
+ * 	For microtonal work, #define MIDI_MTS as 1 and the library decodes MIDI Tuning Standard SysEx
+ * 	(bulk tuning dumps, single note tuning changes and scale/octave tuning) into a 128-entry pitch
+ * 	table per channel. MIDI_getTuning(channel) returns the live table, holding the frequency in Hz
+ * 	of every note, or the oscillator phase increment if MIDI_MTS_SAMPLE_RATE is #define-d, so nothing
+ * 	has to be computed at note-on. Each table is triple-buffered: a tuning message is written to a
+ * 	spare copy and goes live in one step when the message ends, so read the pointer once per audio
+ * 	block. MIDI_getTuning marks the table it returns as held, and tuning messages are never written
+ * 	into the live or the held table, so the table a block is reading does not change under it however
+ * 	many swaps happen meanwhile. Bulk dumps and single note changes apply to all channels. The tables
+ * 	take 24KB of RAM. Phase increments of notes at or above the sample rate are clamped to 0xFFFFFFFF.
+ *
+ * 	Mono synths (note priority) and arpeggiators can #define MIDI_HELD_NOTES as 1 and attach a
+ * 	MIDI_HeldNotes set to a channel with MIDI_attachHeldNotes(channel, &notes). The parser then keeps
+ * 	it up to date: notes->newest is the last note played, MIDI_heldLowest/MIDI_heldHighest give the
+ * 	lowest/highest held note, and the notes can be walked in play order (notes->older[]/newer[]) or
+ * 	pitch order (MIDI_heldAbove/MIDI_heldBelow). Adding and removing a note are O(1).
+ *
+ * 	#define MIDI_PEDALS as 1 to let the library handle the sustain (CC 64) and sostenuto (CC 66)
+ * 	pedals: while a pedal holds a note, its note-off is held back, and MIDI_noteOff is called for it
+ * 	when the pedal is lifted. Your code then only has to deal with plain note-ons and note-offs. The
+ * 	pedal CCs (and the soft pedal, CC 67, which doesn't affect note lengths) are still passed on to
+ * 	MIDI_CC. All Notes Off and All Sound Off (CC 123/120) drop the notes the pedals hold but leave the
+ * 	pedals down; MIDI_allNotesOff (System Reset, Active Sensing timeout) lifts them as well.
+ *
+ * 	Patch changes can be prefetched by #define-ing MIDI_PRESETS as 1. Bank select (CC 0/32) and
+ * 	program change are then combined into one preset request, and the library keeps a small LRU cache
+ * 	of recently used presets (MIDI_PRESET_CACHE_SLOTS slots; the preset data lives in your own
+ * 	buffers, one per slot). Two more callbacks are used:
+ * 	- MIDI_presetLoad(uint8_t slot, uint16_t bank, uint8_t program)
+ * 		called when a requested preset isn't cached. Start an asynchronous (DMA/QSPI) read of the preset
+ * 		into the buffer of that slot and call MIDI_presetLoaded(slot) when it completes (this may be
+ * 		done from the transfer-complete interrupt).
+ * 	- MIDI_presetChange(uint8_t channel, uint16_t bank, uint8_t program, uint8_t slot)
+ * 		called once the preset data is in its slot (immediately for cached presets). Switch the channel
+ * 		to it. If slot is MIDI_PRESET_NO_SLOT, every slot was in use (or still loading) and you have to
+ * 		load it yourself; the channel then plays from no slot.
+ *
+ * 	For latency-critical triggers (e.g. drums), #define MIDI_ISR_NOTE_ON as 1 and implement
+ * 	- MIDI_noteOnFast(uint8_t channel, uint8_t note_num, uint8_t velocity)
+ * 			called from the UART/DMA receive interrupt for every note-on (channel 0-15, after the
+ * 			MIDI_init channel filter but before filter rules, zones and pedals), as soon as its bytes
+ * 			arrive. This saves waiting for the next MIDI_check. The note-on still reaches MIDI_noteOn
+ * 			(or its handler) through MIDI_check as usual, so ignore it there if you already triggered it.
+ * 			As this runs in an interrupt it must be short: no HAL calls, no blocking, no MIDI_ functions.
+ * 			The library's part costs a few cycles per received byte. MIDI_noteOnFast is only ever called
+ * 			from the interrupt: while MIDI_RX_MODERATION polls the DMA from MIDI_check, the note-ons found
+ * 			by the poll only take the normal path.
+ *
+ * 	On STM32 parts with DMA streams (F2/F4/F7/H7), #define MIDI_DMA_DOUBLE_BUFFER as 1 to receive
+ * 	with the stream in double-buffer mode instead of a circular buffer. The two halves of the buffer
+ * 	are then separate DMA targets: a full half is handed over whole and only written again once the
+ * 	other half is full too, which MIDI_check can track exactly. Configure the UART RX DMA as for the
+ * 	default mode (circular, byte width, memory increment); MIDI_init sets up the rest.
+ *
+ * 	To skip the HAL's generic interrupt dispatch, #define MIDI_DIRECT_IRQ as 1. Then don't call
+ * 	HAL_UART_IRQHandler and HAL_DMA_IRQHandler for the MIDI UART and its RX DMA; call
+ * 	MIDI_UART_IRQHandler() from the USARTx_IRQHandler and MIDI_DMA_IRQHandler() from the DMA
+ * 	stream/channel IRQHandler (in stm32xxxx_it.c) instead. These read the DMA counter and clear the
+ * 	flags themselves, and USE_HAL_UART_REGISTER_CALLBACKS is no longer needed.
+ *
+ * 	On U(S)ARTs with a receiver timeout (F0/F3/F7/G4/H7/L4...) and MIDI_DIRECT_IRQ, #define
+ * 	MIDI_RX_TIMEOUT as 1 to end bursts with the programmable receiver timeout instead of the fixed
+ * 	one-byte IDLE event. The timeout adapts to the traffic: long bursts double it (up to
+ * 	MIDI_RX_TIMEOUT_MAX bit times, the latency ceiling), so dense streams raise fewer interrupts, and
+ * 	short ones halve it (down to MIDI_RX_TIMEOUT_MIN), so a lone message still gets through quickly.
+ *
+ * 	Heavy streams (long SysEx dumps, merged inputs) can raise thousands of IDLE interrupts a second.
+ * 	#define MIDI_RX_MODERATION as 1 to let MIDI_check watch the byte rate: above MIDI_MODERATION_HIGH
+ * 	bytes/s the IDLE interrupt is turned off and MIDI_check polls the DMA position instead, at most
+ * 	MIDI_MODERATION_LATENCY ms apart (provided the main loop runs that often). Below
+ * 	MIDI_MODERATION_LOW bytes/s the IDLE interrupt comes back for the lowest latency.
+ *
+ * 	To find out whether a slow MIDI response comes from the library or from your callbacks, #define
+ * 	MIDI_PROFILING as 1 (Cortex-M3 and up, uses the DWT cycle counter). Every handler call is timed
+ * 	per message class, separately from the parser's own time (MIDI_presetLoad and MIDI_presetChange
+ * 	count as program change handlers); read the totals with MIDI_getProfile.
+ * 	A call taking longer than MIDI_HANDLER_BUDGET_US microseconds is reported to
+ * 	- MIDI_handlerOverrun(MIDI_MsgClass msg, uint8_t channel, uint32_t cycles)
+ * 		called right after the handler returns (channel 0-15), e.g. to log it or blink an LED.
+ *
+ * 	To size the buffer from real data rather than guesswork, #define MIDI_RX_STATS as 1. MIDI_check
+ * 	then records the deepest backlog (received bytes waiting to be parsed) and the longest time
+ * 	between two MIDI_check calls; read them with MIDI_getRxStats after a representative session
+ * 	(e.g. a full SysEx dump). A backlog of MIDI_BUFF_SIZE or more means the DMA overwrote data
+ * 	before MIDI_check got to it. MIDI_recommendBufferSize turns them into a MIDI_BUFF_SIZE. Note that
+ * 	MIDI_check must run at least every MIDI_BUFF_SIZE x 0.32 ms: that's how long the line takes to
+ * 	fill the buffer at full speed.
+ *
+ * 	Stuck notes (a lost note-off) can be caught by #define-ing MIDI_STUCK_NOTES as 1. Every note-on
+ * 	is timestamped, note durations are kept in a histogram (MIDI_getNoteDurations), and
+ * 	- uint8_t MIDI_stuckNote(uint8_t channel, uint8_t note_num, MIDI_StuckReason reason, uint32_t held_ms)
+ * 		is called (channel 0-15) when a note is held longer than MIDI_STUCK_NOTE_TIMEOUT ms
+ * 		(MIDI_STUCK_TIMEOUT), or struck again without a note-off in between (MIDI_STUCK_RETRIGGER).
+ * 		Notes held by a pedal don't count. Return 1 to have the library send the missing note-off.
+ *
+ * 	For board-to-board links carrying several virtual MIDI cables over one fast UART (e.g. 2 Mbaud),
+ * 	#define MIDI_MUX as 1. The stream is then read as frames:
+ * 		0xFD, cable (0-15), length (1-127), length bytes of MIDI data, checksum
+ * 	where the checksum is the low 7 bits of the sum of the cable, length and data bytes. A frame can
+ * 	batch any number of messages, and each cable keeps its own running status between frames. Frames
+ * 	with a bad checksum are dropped (MIDI_getFrameErrors). The callbacks get the messages of every
+ * 	cable; call MIDI_getCable() in them to know which one. Held notes are tracked per cable (4.3KB of
+ * 	RAM): MIDI_allNotesOff releases every cable's notes, a System Reset those of its own cable. At such
+ * 	speeds, raise MIDI_BUFF_SIZE to hold a few ms of data. Some options can't be used with MIDI_MUX:
+ * 	MIDI_ISR_NOTE_ON, as the interrupt only sees the raw frames; MIDI_MTS, as a tuning dump split
+ * 	across frames would be cut by the other cables' frames; MIDI_STUCK_NOTES and MIDI_PEDALS, as their
+ * 	state is kept per channel, not per cable.
+ *
+ * 	To record what came in (e.g. to flash, for later analysis), MIDI_log.c/.h provide a compact
+ * 	binary log format and its decoder, with no HAL dependency so the same files build on the host.
+ * 	Events are stored with a millisecond delta time, running status, and flags that elide an
+ * 	exact repeat of the previous event or a control change value already logged for its controller;
+ * 	typical traffic takes 2-3 bytes per message. Logs are cut into fixed-size blocks (MIDI_logBegin,
+ * 	MIDI_logWrite, MIDI_logEnd), each decodable on its own (MIDI_logOpen, MIDI_logRead), so a lost or
+ * 	damaged block doesn't affect the others. Call MIDI_logWrite from the callbacks. On the host,
+ * 	MIDI_smfBegin, MIDI_smfWrite and MIDI_smfEnd turn the decoded events into a Standard MIDI File.
+ *
  * 	The MIDI data buffer is 128-bytes by default. You can override this by #define-ing
  * 	MIDI_BUFF_SIZE to whatever size you want (as long as it's divisible by two).
  *
@@ -78,96 +236,1718 @@
  */
 
 #include "MIDI.h"
-
-#ifndef MIDI_MAX_CMD_LEN
-#define MIDI_MAX_CMD_LEN	8
+#include <string.h>
+#if MIDI_MTS
+#include <math.h>
 #endif
 
 #ifndef MIDI_BUFF_SIZE
 #define MIDI_BUFF_SIZE		128
 #endif
 
-uint8_t MIDI_data_rcv;
-uint8_t MIDI_rx_flag;
-uint8_t MIDI_rx_half;
+#ifndef MIDI_ALL_NOTES_OFF_MIN
+#define MIDI_ALL_NOTES_OFF_MIN	2	//held notes on a channel from which CC 123 is used instead of note-offs
+#endif
+
+#ifndef MIDI_ACTIVE_SENSING_TIMEOUT
+#define MIDI_ACTIVE_SENSING_TIMEOUT	300	//ms of silence after an Active Sensing byte before the port is considered disconnected
+#endif
+
+uint8_t MIDI_data_rcv;
+uint8_t MIDI_rx_flag;
+uint8_t MIDI_rx_half;
+volatile uint8_t MIDI_rx_stopped; //set when a DMA error stopped reception (MIDI_check starts it again)
+
+UART_HandleTypeDef* MIDI_uart; //uart pointer
+
+uint8_t MIDI_buffer[MIDI_BUFF_SIZE]; //MIDI buffer
+uint16_t MIDI_buffer_index; //index of current byte (initialized to 0)
+uint8_t MIDI_message_length; //total number of bytes (including status) to expect
+uint16_t MIDI_max_valid; //index of last valid byte in array (stop point for MIDI_check)
+uint8_t MIDI_cmd_state; //FSM parameter for MIDI check (0: status byte, 1: data 1, 2: data 2, etc.)
+uint8_t MIDI_cmd_stage[MIDI_MAX_CMD_LEN]; //staging area for MIDI command as bytes come in (always re-centered around status byte)
+uint8_t MIDI_channel; //MIDI channel to listen to
+uint8_t MIDI_sysex; //set while a SysEx message is being received
+uint8_t MIDI_active_sensing; //set once the sender has transmitted Active Sensing (0xFE)
+uint32_t MIDI_last_rx_tick; //HAL tick of the last received data
+
+#if MIDI_RX_STATS
+#define MIDI_BYTE_US		320	//a byte (10 bits) takes 320us at 31250 bps
+
+MIDI_RxStats MIDI_rx_stats; //buffer statistics since MIDI_init or MIDI_resetRxStats
+uint32_t MIDI_last_check_tick; //HAL tick of the last MIDI_check call
+uint32_t MIDI_rx_consumed; //MIDI_rx_received as of the last data MIDI_check parsed
+#endif
+
+#if MIDI_MUX
+#if MIDI_ISR_NOTE_ON
+#error "MIDI_ISR_NOTE_ON can't be combined with MIDI_MUX (the RX interrupt sees the frames, not the cables' messages)"
+#endif
+#if MIDI_MTS
+#error "MIDI_MTS can't be combined with MIDI_MUX (a tuning dump split across frames would be cut by the other cables)"
+#endif
+#if MIDI_STUCK_NOTES || MIDI_PEDALS
+#error "MIDI_STUCK_NOTES and MIDI_PEDALS can't be combined with MIDI_MUX (their state is per channel, not per cable)"
+#endif
+#define MIDI_MUX_SYNC		0xFD	//frame start: an undefined MIDI byte, so it never occurs inside a frame
+
+/* MIDI_CableState
+ * The running status and partial message of a cable's parser while another cable is being parsed.
+ */
+typedef struct {
+	uint8_t cmd_state;
+	uint8_t message_length;
+	uint8_t cmd_stage[MIDI_MAX_CMD_LEN];
+	uint8_t sysex;
+} MIDI_CableState;
+
+MIDI_CableState MIDI_cables[16]; //parser state of the cables not being parsed
+uint8_t MIDI_cable; //cable whose messages are being parsed (its state is the live one)
+uint8_t MIDI_mux_state; //frame decoder: 0 hunting for sync, 1 cable, 2 length, 3 payload, 4 checksum
+uint8_t MIDI_mux_cable; //cable of the frame being received
+uint8_t MIDI_mux_length; //payload length of the frame being received
+uint8_t MIDI_mux_count; //payload bytes received so far
+uint8_t MIDI_mux_sum; //running checksum
+uint8_t MIDI_mux_payload[127]; //payload, held back until its checksum has been verified
+uint32_t MIDI_mux_errors; //frames dropped (bad checksum, bad header or cut short)
+#endif
+
+#if MIDI_NOTE_TRACKING
+#if MIDI_MUX
+uint32_t MIDI_cable_notes_held[16][16][4]; //bitmap of held notes per cable and channel
+uint8_t MIDI_cable_notes_held_count[16][16]; //number of held notes per cable and channel
+#define MIDI_notes_held			MIDI_cable_notes_held[MIDI_cable] //those of the cable being parsed
+#define MIDI_notes_held_count	MIDI_cable_notes_held_count[MIDI_cable]
+#else
+uint32_t MIDI_notes_held[16][4]; //bitmap of held notes per channel (note n is bit n%32 of word n/32)
+uint8_t MIDI_notes_held_count[16]; //number of held notes per channel
+#endif
+#endif
+
+#if MIDI_STUCK_NOTES
+#if !MIDI_NOTE_TRACKING
+#error "MIDI_STUCK_NOTES needs MIDI_NOTE_TRACKING"
+#endif
+#if MIDI_STUCK_NOTE_TIMEOUT > 30000
+#error "MIDI_STUCK_NOTE_TIMEOUT must be at most 30000 (note-on times are 16-bit)"
+#endif
+
+#define MIDI_STUCK_SCAN_INTERVAL	100	//ms between two scans for notes held past MIDI_STUCK_NOTE_TIMEOUT
+
+uint16_t MIDI_note_on_tick[16][128]; //HAL tick (low 16 bits) of each held note's note-on
+uint32_t MIDI_notes_stuck[16][4]; //held notes already reported as stuck
+uint32_t MIDI_note_durations[MIDI_DURATION_BUCKETS]; //note duration histogram
+uint32_t MIDI_stuck_scan_tick; //HAL tick of the last stuck note scan
+#endif
+
+#if MIDI_PEDALS
+#if !MIDI_NOTE_TRACKING
+#error "MIDI_PEDALS needs MIDI_NOTE_TRACKING"
+#endif
+
+uint16_t MIDI_pedal_sustain; //channels (bitmask) with the sustain pedal down
+uint16_t MIDI_pedal_sostenuto; //channels (bitmask) with the sostenuto pedal down
+uint32_t MIDI_pedal_deferred[16][4]; //notes whose note-off is held back by a pedal, per channel
+uint32_t MIDI_pedal_latched[16][4]; //notes caught by the sostenuto pedal, per channel
+#endif
+
+#if MIDI_PRESETS
+#if MIDI_PRESET_CACHE_SLOTS > 254
+#error "MIDI_PRESET_CACHE_SLOTS must be at most 254"
+#endif
+
+#define MIDI_PRESET_NONE	0xFFFFFFFFUL	//cache slot holds no preset
+
+uint8_t MIDI_bank_msb[16]; //last bank select MSB (CC 0) per channel
+uint8_t MIDI_bank_lsb[16]; //last bank select LSB (CC 32) per channel
+uint32_t MIDI_preset_ids[MIDI_PRESET_CACHE_SLOTS]; //preset (bank << 7 | program) held by each cache slot
+uint8_t MIDI_preset_lru[MIDI_PRESET_CACHE_SLOTS]; //cache slots, most recently used first
+volatile uint8_t MIDI_preset_ready[MIDI_PRESET_CACHE_SLOTS]; //slot data fully loaded (set by MIDI_presetLoaded)
+uint8_t MIDI_preset_active[16]; //slot each channel plays from (MIDI_PRESET_NO_SLOT if none)
+uint8_t MIDI_preset_pending[16]; //slot each channel is waiting for (MIDI_PRESET_NO_SLOT if none)
+uint16_t MIDI_preset_waiting; //channels (bitmask) waiting for a preset to load
+#endif
+
+#if MIDI_HELD_NOTES
+MIDI_HeldNotes* MIDI_held_sets[16]; //held-note sets fed by the parser, per channel (NULL: none)
+#endif
+
+#if MIDI_CHANNEL_HANDLERS
+typedef struct {
+	MIDI_Handler handler;
+	void* context;
+} MIDI_HandlerEntry;
+
+MIDI_HandlerEntry MIDI_handlers[16][MIDI_MSG_COUNT]; //per-channel handlers, indexed by [channel][message class]
+#endif
+
+#if MIDI_FILTER_RULES
+#if MIDI_FILTER_DATA_TABLES > 127
+#error "MIDI_FILTER_DATA_TABLES must be at most 127"
+#endif
+
+#define MIDI_FILTER_PASS	0x7F	//MIDI_FilterTable entry: no rule matched, deliver unchanged
+
+const MIDI_FilterTable* volatile MIDI_filter; //compiled filter/route table in use (NULL: pass everything)
+#endif
+
+#if MIDI_MTS
+#define MIDI_MTS_BULK_DUMP		0x01	//non-real-time bulk tuning dump
+#define MIDI_MTS_NOTE_CHANGE		0x02	//real-time single note tuning change
+#define MIDI_MTS_BANK_NOTE_CHANGE	0x07	//single note tuning change with bank select
+#define MIDI_MTS_SCALE_1BYTE		0x08	//scale/octave tuning, 1-byte form
+#define MIDI_MTS_SCALE_2BYTE		0x09	//scale/octave tuning, 2-byte form
+
+MIDI_Pitch MIDI_tuning[16][3][128]; //three pitch tables per channel: live, held by the audio side, being edited
+volatile uint8_t MIDI_tuning_front[16]; //which of the three tables of each channel is live
+volatile uint8_t MIDI_tuning_held[16]; //which table the audio side last fetched with MIDI_getTuning
+uint8_t MIDI_tuning_back[16]; //which table the current message is editing (neither live nor held)
+uint8_t MIDI_tuning_ready; //set once the tables hold 12-TET (they survive re-init afterwards)
+uint16_t MIDI_sysex_count; //data bytes received in the current SysEx message (saturates at 0xFFFF)
+uint8_t MIDI_mts_format; //MTS message being decoded (MIDI_MTS_...), 0 if the SysEx isn't one we decode
+uint8_t MIDI_mts_ready; //current message has produced a complete change that can go live at F7
+uint8_t MIDI_mts_checksum; //running XOR for the bulk dump checksum
+uint16_t MIDI_mts_edit; //channels (bitmask) whose back table the current message is editing
+uint8_t MIDI_mts_bytes[24]; //header fields, note groups and scale offsets being gathered
+#endif
+
+#if MIDI_ZONES
+#if MIDI_ZONE_COUNT > 8
+#error "MIDI_ZONE_COUNT must be at most 8"
+#endif
+
+MIDI_Zone MIDI_zones[MIDI_ZONE_COUNT]; //output channel, transpose and velocity scaling per zone
+uint8_t MIDI_zone_map[16][128]; //zones (bitmask) each note of each input channel plays in
+uint8_t MIDI_zone_inputs[16]; //zones (bitmask) fed by each input channel, for non-note messages
+#endif
+
+#if MIDI_ISR_NOTE_ON
+uint16_t MIDI_isr_index; //next byte the ISR-side note-on scanner looks at
+uint8_t MIDI_isr_status; //running note-on status seen by the scanner (0 if the running status isn't a note-on)
+uint8_t MIDI_isr_count; //data bytes the scanner has collected under it
+uint8_t MIDI_isr_note; //note number of the note-on being collected
+uint8_t MIDI_isr_quiet; //set while MIDI_check polls the DMA: scan, but leave the note-ons to MIDI_check
+
+/* MIDI_isrScan
+ * @brief 	Looks for note-ons in the bytes the DMA has written since the last interrupt and calls
+ * 			MIDI_noteOnFast for each one, ahead of the normal MIDI_check path. Runs in the UART/DMA
+ * 			interrupt: it only tracks running status, so its cost is a few cycles per new byte and at
+ * 			most MIDI_BUFF_SIZE bytes per interrupt.
+ * @param	end			DMA write position (number of valid bytes in the buffer).
+ */
+static void MIDI_isrScan(uint16_t end) {
+	uint16_t i = MIDI_isr_index;
+	while (i != end) {
+		if (i >= MIDI_BUFF_SIZE) {
+			i = 0; //the DMA has wrapped around
+			if (end == 0) {
+				break;
+			}
+		}
+		uint8_t new_byte = MIDI_buffer[i++];
+		if (new_byte >= 0xF8) {
+			//real-time byte: doesn't affect running status
+		}
+		else if (new_byte >= 0x80) {
+			MIDI_isr_status = ((new_byte & 0xF0) == 0x90) ? new_byte : 0;
+			MIDI_isr_count = 0;
+		}
+		else if (MIDI_isr_status != 0) {
+			if (MIDI_isr_count == 0) {
+				MIDI_isr_note = new_byte;
+				MIDI_isr_count = 1;
+			}
+			else {
+				uint8_t channel = MIDI_isr_status & 0x0F;
+				MIDI_isr_count = 0;
+				if ((new_byte != 0) && !MIDI_isr_quiet && ((MIDI_channel == MIDI_CHANNEL_ALL) || (channel == MIDI_channel))) {
+					MIDI_noteOnFast(channel, MIDI_isr_note, new_byte);
+				}
+			}
+		}
+	}
+	MIDI_isr_index = (end >= MIDI_BUFF_SIZE) ? 0 : end;
+}
+#endif
+
+#if MIDI_RX_MODERATION
+#if MIDI_RX_TIMEOUT
+#error "MIDI_RX_MODERATION and MIDI_RX_TIMEOUT are alternatives, enable only one"
+#endif
+
+#ifndef MIDI_MODERATION_LATENCY
+#define MIDI_MODERATION_LATENCY		2	//ms between DMA position polls while moderated (the latency ceiling)
+#endif
+
+#ifndef MIDI_MODERATION_WINDOW
+#define MIDI_MODERATION_WINDOW		50	//ms over which the byte rate is measured
+#endif
+
+#ifndef MIDI_MODERATION_HIGH
+#define MIDI_MODERATION_HIGH		1000	//bytes/s from which IDLE interrupts are turned off (the line carries 3125 at most)
+#endif
+
+#ifndef MIDI_MODERATION_LOW
+#define MIDI_MODERATION_LOW			250	//bytes/s below which IDLE interrupts are turned back on
+#endif
+
+uint32_t MIDI_mod_counted; //MIDI_rx_received at the start of the current window
+uint32_t MIDI_mod_window_tick; //HAL tick the current window started at
+uint32_t MIDI_mod_poll_tick; //HAL tick of the last DMA position poll
+uint8_t MIDI_mod_polling; //set while IDLE interrupts are off and MIDI_check polls instead
+#endif
+
+#if MIDI_RX_MODERATION || MIDI_RX_STATS
+volatile uint32_t MIDI_rx_received; //bytes the DMA has reported so far (only written in the receive interrupt)
+uint16_t MIDI_rx_position; //DMA write position at the last report
+#endif
+
+/* MIDI_rxProgress
+ * @brief 	Called from the receive interrupt with the new DMA write position, for the features that
+ * 			watch the raw stream.
+ * @param	end			DMA write position (number of valid bytes in the buffer).
+ */
+static void MIDI_rxProgress(uint16_t end) {
+#if MIDI_ISR_NOTE_ON
+	MIDI_isrScan(end);
+#endif
+#if MIDI_RX_MODERATION || MIDI_RX_STATS
+	// reports come at least every half buffer, so the distance is never ambiguous
+	MIDI_rx_received += (end + MIDI_BUFF_SIZE - MIDI_rx_position) % MIDI_BUFF_SIZE;
+	MIDI_rx_position = end % MIDI_BUFF_SIZE;
+#endif
+}
+
+#if MIDI_DMA_DOUBLE_BUFFER
+#if !defined(DMA_SxCR_DBM)
+#error "MIDI_DMA_DOUBLE_BUFFER needs a DMA stream with double-buffer mode (DMA_SxCR_DBM)"
+#endif
+
+#define MIDI_DMA_BLOCK		(MIDI_BUFF_SIZE / 2)	//size of each of the two DMA target blocks
+
+volatile uint8_t MIDI_dma_full[2]; //block completed by the DMA and not yet parsed (set in the DMA interrupt)
+volatile uint16_t MIDI_dma_fill[2]; //bytes in a block so far, as reported by the last IDLE event
+uint8_t MIDI_dma_block; //block MIDI_check is reading
+uint16_t MIDI_dma_read; //bytes of that block already parsed
+
+/* MIDI_dmaBlockDone
+ * @brief 	A DMA target block is full and the stream has switched to the other one by itself.
+ * @param	block		The completed block (0 or 1).
+ */
+static void MIDI_dmaBlockDone(uint8_t block) {
+	MIDI_dma_full[block] = 1;
+	MIDI_rx_flag = 1;
+	MIDI_rxProgress((block + 1) * MIDI_DMA_BLOCK);
+}
+
+static void MIDI_dmaM0Done(DMA_HandleTypeDef* hdma) {
+	MIDI_dmaBlockDone(0);
+}
+
+static void MIDI_dmaM1Done(DMA_HandleTypeDef* hdma) {
+	MIDI_dmaBlockDone(1);
+}
+
+static void MIDI_dmaError(DMA_HandleTypeDef* hdma) {
+	MIDI_rx_stopped = 1; //a transfer error stops the stream
+}
+
+/* MIDI_dmaStart
+ * @brief 	Starts reception with the DMA stream in double-buffer mode: the two halves of MIDI_buffer
+ * 			are separate DMA targets and the stream moves on to the other one by itself when a half is
+ * 			full, so a completed half is never written again before it has been handed over. Full halves
+ * 			are reported by the DMA interrupt, partially filled ones by the UART IDLE event, which the
+ * 			HAL reports just like for HAL_UARTEx_ReceiveToIdle_DMA.
+ * @param 	huart		The handle of the UART to listen to.
+ */
+static void MIDI_dmaStart(UART_HandleTypeDef* huart) {
+	DMA_HandleTypeDef* hdma = huart->hdmarx;
+	MIDI_dma_full[0] = 0;
+	MIDI_dma_full[1] = 0;
+	MIDI_dma_fill[0] = 0;
+	MIDI_dma_fill[1] = 0;
+	MIDI_dma_block = 0;
+	MIDI_dma_read = 0;
+	hdma->XferCpltCallback = MIDI_dmaM0Done;
+	hdma->XferM1CpltCallback = MIDI_dmaM1Done;
+	hdma->XferHalfCpltCallback = NULL; //whole blocks only
+	hdma->XferM1HalfCpltCallback = NULL;
+	hdma->XferErrorCallback = MIDI_dmaError;
+	hdma->XferAbortCallback = NULL;
+	// let HAL_UART_IRQHandler report IDLE events (Size = bytes in the current block)
+	huart->ReceptionType = HAL_UART_RECEPTION_TOIDLE;
+	huart->RxXferSize = MIDI_DMA_BLOCK;
+	huart->ErrorCode = HAL_UART_ERROR_NONE;
+	huart->RxState = HAL_UART_STATE_BUSY_RX;
+#if defined(USART_RDR_RDR)
+	uint32_t data_register = (uint32_t)&huart->Instance->RDR;
+#else
+	uint32_t data_register = (uint32_t)&huart->Instance->DR;
+#endif
+	HAL_DMAEx_MultiBufferStart_IT(hdma, data_register, (uint32_t)&MIDI_buffer[0], (uint32_t)&MIDI_buffer[MIDI_DMA_BLOCK], MIDI_DMA_BLOCK);
+	__HAL_UART_CLEAR_IDLEFLAG(huart);
+	SET_BIT(huart->Instance->CR1, USART_CR1_IDLEIE);
+	SET_BIT(huart->Instance->CR3, USART_CR3_DMAR); //start feeding the DMA
+}
+#endif
+
+/* MIDI_rxEvent
+ * @brief 	Record how far the DMA has written and set the flag MIDI_check looks at. Called from the
+ * 			receive interrupt, through MIDI_DATA_RX or the direct IRQ handlers.
+ * @param	event		HAL_UART_RXEVENT_HT, HAL_UART_RXEVENT_TC or HAL_UART_RXEVENT_IDLE.
+ * @param	Size		The size/amount of data that is received/valid.
+ */
+static void MIDI_rxEvent(uint32_t event, uint16_t Size) {
+#if MIDI_DMA_DOUBLE_BUFFER
+	if (event == HAL_UART_RXEVENT_IDLE) {
+		// the line is idle, so the stream can't have switched blocks since its counter was read
+		uint8_t block = (((DMA_Stream_TypeDef*)MIDI_uart->hdmarx->Instance)->CR & DMA_SxCR_CT) ? 1 : 0;
+		MIDI_dma_fill[block] = Size;
+		MIDI_rx_flag = 1;
+		MIDI_rxProgress(block * MIDI_DMA_BLOCK + Size);
+	}
+#else
+	if (event == HAL_UART_RXEVENT_HT) {
+		MIDI_rx_flag = 1; //first half ready
+		MIDI_rx_half = 1;
+		MIDI_max_valid = Size;
+	}
+	else if (event == HAL_UART_RXEVENT_TC) {
+		MIDI_rx_flag = 1; //second half ready
+		MIDI_rx_half = 2;
+		MIDI_max_valid = Size;
+	}
+	else if (event == HAL_UART_RXEVENT_IDLE) {
+		MIDI_rx_flag = 1; //received data ready (undetermined half)
+		MIDI_max_valid = Size;
+	}
+	MIDI_rxProgress(Size);
+#endif
+}
+
+#if MIDI_RX_MODERATION
+/* MIDI_rxPoll
+ * @brief 	Stands in for the IDLE interrupt while moderated: reports what the DMA has written so far,
+ * 			with interrupts masked as the HT/TC interrupts update the same state.
+ */
+static void MIDI_rxPoll() {
+	DMA_HandleTypeDef* hdma = MIDI_uart->hdmarx;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+#if MIDI_ISR_NOTE_ON
+	MIDI_isr_quiet = 1; //not in an interrupt, and MIDI_check delivers these note-ons right after anyway
+#endif
+#if MIDI_DMA_DOUBLE_BUFFER
+	// unlike after an IDLE event, the stream may be switching blocks right now
+	uint32_t target = ((DMA_Stream_TypeDef*)hdma->Instance)->CR & DMA_SxCR_CT;
+	uint16_t size = MIDI_DMA_BLOCK - __HAL_DMA_GET_COUNTER(hdma);
+	if ((size > 0) && (target == (((DMA_Stream_TypeDef*)hdma->Instance)->CR & DMA_SxCR_CT))) {
+		MIDI_rxEvent(HAL_UART_RXEVENT_IDLE, size);
+	}
+#else
+	uint16_t size = MIDI_BUFF_SIZE - __HAL_DMA_GET_COUNTER(hdma);
+	// only report progress within the current lap; wrapping around is left to the TC event
+	if ((size > MIDI_buffer_index) && (!MIDI_rx_flag || (size > MIDI_max_valid))) {
+		MIDI_rxEvent(HAL_UART_RXEVENT_IDLE, size);
+	}
+#endif
+#if MIDI_ISR_NOTE_ON
+	MIDI_isr_quiet = 0;
+#endif
+	__set_PRIMASK(primask);
+}
+
+/* MIDI_moderate
+ * @brief 	Interrupt moderation policy, run from MIDI_check. While the byte rate is low, every pause in
+ * 			the stream raises an IDLE interrupt for the lowest latency. Above MIDI_MODERATION_HIGH
+ * 			bytes/s the IDLE interrupt is turned off: data then comes through the HT/TC interrupts and
+ * 			a DMA position poll every MIDI_MODERATION_LATENCY ms. Below MIDI_MODERATION_LOW it is
+ * 			turned back on.
+ */
+static void MIDI_moderate() {
+	uint32_t now = HAL_GetTick();
+	if ((now - MIDI_mod_window_tick) >= MIDI_MODERATION_WINDOW) {
+		uint32_t received = MIDI_rx_received;
+		uint32_t rate = (received - MIDI_mod_counted) * 1000 / (now - MIDI_mod_window_tick);
+		MIDI_mod_counted = received;
+		MIDI_mod_window_tick = now;
+		if (!MIDI_mod_polling && (rate >= MIDI_MODERATION_HIGH)) {
+			MIDI_mod_polling = 1;
+			MIDI_mod_poll_tick = now;
+			__HAL_UART_DISABLE_IT(MIDI_uart, UART_IT_IDLE);
+		}
+		else if (MIDI_mod_polling && (rate < MIDI_MODERATION_LOW)) {
+			MIDI_mod_polling = 0;
+			MIDI_rxPoll(); //catch up before handing back to IDLE
+			__HAL_UART_ENABLE_IT(MIDI_uart, UART_IT_IDLE); //a stale IDLE flag only causes one extra report
+		}
+	}
+	if (MIDI_mod_polling && ((now - MIDI_mod_poll_tick) >= MIDI_MODERATION_LATENCY)) {
+		MIDI_mod_poll_tick = now;
+		MIDI_rxPoll();
+	}
+}
+#endif
+
+#if MIDI_RX_TIMEOUT
+#if !MIDI_DIRECT_IRQ
+#error "MIDI_RX_TIMEOUT needs MIDI_DIRECT_IRQ (HAL_UART_IRQHandler treats a receiver timeout as an error)"
+#endif
+#if !defined(USART_CR2_RTOEN)
+#error "MIDI_RX_TIMEOUT needs a U(S)ART with a receiver timeout (RTOR register)"
+#endif
+
+#ifndef MIDI_RX_TIMEOUT_MIN
+#define MIDI_RX_TIMEOUT_MIN		22	//bit times of silence that end a burst while traffic is sparse (a byte is 10 bits)
+#endif
+
+#ifndef MIDI_RX_TIMEOUT_MAX
+#define MIDI_RX_TIMEOUT_MAX		320	//bit times while traffic is dense; the latency ceiling (320 = ~10ms at 31250 bps)
+#endif
+
+#ifndef MIDI_RX_TIMEOUT_DENSE
+#define MIDI_RX_TIMEOUT_DENSE	24	//bytes in a burst from which traffic counts as dense
+#endif
+
+uint32_t MIDI_rto_bits; //current receiver timeout, in bit times
+uint16_t MIDI_rto_position; //DMA write position at the last timeout
+
+/* MIDI_rtoStart
+ * @brief 	Ends bursts with the receiver timeout instead of the IDLE event: RTOF is raised after
+ * 			MIDI_rto_bits bit times without a new start bit.
+ * @param 	huart		The handle of the UART to listen to.
+ */
+static void MIDI_rtoStart(UART_HandleTypeDef* huart) {
+	MIDI_rto_bits = MIDI_RX_TIMEOUT_MIN;
+	MIDI_rto_position = 0;
+	CLEAR_BIT(huart->Instance->CR1, USART_CR1_IDLEIE); //the timeout takes over from IDLE
+	MODIFY_REG(huart->Instance->RTOR, USART_RTOR_RTO, MIDI_rto_bits);
+	__HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_RTOF);
+	SET_BIT(huart->Instance->CR2, USART_CR2_RTOEN);
+	SET_BIT(huart->Instance->CR1, USART_CR1_RTOIE);
+}
+
+/* MIDI_rtoAdapt
+ * @brief 	Adjusts the receiver timeout to the size of the burst that just ended. Dense traffic
+ * 			(long bursts) doubles it, so that short gaps inside the stream stop raising interrupts;
+ * 			sparse traffic halves it again, so that a lone message is reported right after its last
+ * 			byte. Data keeps coming through the HT/TC events while the timeout is long.
+ * @param 	huart		The handle of the UART.
+ * @param	position	DMA write position in MIDI_buffer.
+ */
+static void MIDI_rtoAdapt(UART_HandleTypeDef* huart, uint16_t position) {
+	uint16_t burst = (position + MIDI_BUFF_SIZE - MIDI_rto_position) % MIDI_BUFF_SIZE;
+	MIDI_rto_position = position;
+	if ((burst >= MIDI_RX_TIMEOUT_DENSE) && (MIDI_rto_bits < MIDI_RX_TIMEOUT_MAX)) {
+		MIDI_rto_bits = (MIDI_rto_bits * 2 > MIDI_RX_TIMEOUT_MAX) ? MIDI_RX_TIMEOUT_MAX : MIDI_rto_bits * 2;
+	}
+	else if ((burst < MIDI_RX_TIMEOUT_DENSE / 4) && (MIDI_rto_bits > MIDI_RX_TIMEOUT_MIN)) {
+		MIDI_rto_bits = (MIDI_rto_bits / 2 < MIDI_RX_TIMEOUT_MIN) ? MIDI_RX_TIMEOUT_MIN : MIDI_rto_bits / 2;
+	}
+	else {
+		return;
+	}
+	MODIFY_REG(huart->Instance->RTOR, USART_RTOR_RTO, MIDI_rto_bits); //takes effect from the next byte
+}
+#endif
+
+#if MIDI_DIRECT_IRQ
+/* MIDI_rxPause
+ * @brief 	The line went quiet (IDLE or receiver timeout): report what the DMA has written so far.
+ * @param 	huart		The handle of the UART.
+ */
+static void MIDI_rxPause(UART_HandleTypeDef* huart) {
+#if MIDI_DMA_DOUBLE_BUFFER
+	uint16_t size = MIDI_DMA_BLOCK - __HAL_DMA_GET_COUNTER(huart->hdmarx);
+#else
+	uint16_t size = MIDI_BUFF_SIZE - __HAL_DMA_GET_COUNTER(huart->hdmarx);
+#endif
+#if MIDI_RX_TIMEOUT
+#if MIDI_DMA_DOUBLE_BUFFER
+	uint16_t position = size + ((((DMA_Stream_TypeDef*)huart->hdmarx->Instance)->CR & DMA_SxCR_CT) ? MIDI_DMA_BLOCK : 0);
+#else
+	uint16_t position = size;
+#endif
+	MIDI_rtoAdapt(huart, position);
+#endif
+	if (size > 0) { //0: nothing new since the last HT/TC
+		MIDI_rxEvent(HAL_UART_RXEVENT_IDLE, size);
+	}
+}
+
+/* MIDI_UART_IRQHandler
+ * @brief 	Replaces HAL_UART_IRQHandler for the MIDI UART (see MIDI_DIRECT_IRQ). Handles the IDLE
+ * 			(or receiver timeout) event straight from the status register and clears line errors,
+ * 			which don't stop the DMA.
+ */
+void MIDI_UART_IRQHandler() {
+	UART_HandleTypeDef* huart = MIDI_uart;
+	// IDLE first: on some families clearing the error flags clears IDLE as well
+	if (__HAL_UART_GET_FLAG(huart, UART_FLAG_IDLE) && __HAL_UART_GET_IT_SOURCE(huart, UART_IT_IDLE)) {
+		__HAL_UART_CLEAR_IDLEFLAG(huart);
+		MIDI_rxPause(huart);
+	}
+#if MIDI_RX_TIMEOUT
+	if (__HAL_UART_GET_FLAG(huart, UART_FLAG_RTOF)) {
+		__HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_RTOF);
+		MIDI_rxPause(huart);
+	}
+#endif
+	if (__HAL_UART_GET_FLAG(huart, UART_FLAG_ORE) || __HAL_UART_GET_FLAG(huart, UART_FLAG_NE) ||
+			__HAL_UART_GET_FLAG(huart, UART_FLAG_FE) || __HAL_UART_GET_FLAG(huart, UART_FLAG_PE)) {
+		// a lost or damaged byte is handled like any other gap in the stream
+#if defined(USART_ICR_ORECF)
+		__HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_OREF | UART_CLEAR_NEF | UART_CLEAR_FEF | UART_CLEAR_PEF);
+#else
+		__HAL_UART_CLEAR_PEFLAG(huart); //one SR then DR read clears all four (each CLEAR macro would read DR again)
+#endif
+	}
+}
+
+/* MIDI_DMA_IRQHandler
+ * @brief 	Replaces HAL_DMA_IRQHandler for the MIDI UART's RX DMA stream/channel (see MIDI_DIRECT_IRQ).
+ * 			Handles the half/full transfer flags straight from the DMA status register, and restarts
+ * 			the reception (through MIDI_check) after a transfer error.
+ */
+void MIDI_DMA_IRQHandler() {
+	DMA_HandleTypeDef* hdma = MIDI_uart->hdmarx;
+	if (__HAL_DMA_GET_FLAG(hdma, __HAL_DMA_GET_HT_FLAG_INDEX(hdma))) {
+		__HAL_DMA_CLEAR_FLAG(hdma, __HAL_DMA_GET_HT_FLAG_INDEX(hdma));
+#if !MIDI_DMA_DOUBLE_BUFFER
+		MIDI_rxEvent(HAL_UART_RXEVENT_HT, MIDI_BUFF_SIZE / 2);
+#endif
+	}
+	if (__HAL_DMA_GET_FLAG(hdma, __HAL_DMA_GET_TC_FLAG_INDEX(hdma))) {
+		__HAL_DMA_CLEAR_FLAG(hdma, __HAL_DMA_GET_TC_FLAG_INDEX(hdma));
+#if MIDI_DMA_DOUBLE_BUFFER
+		// CT already points at the block the stream has moved on to
+		MIDI_dmaBlockDone((((DMA_Stream_TypeDef*)hdma->Instance)->CR & DMA_SxCR_CT) ? 0 : 1);
+#else
+		MIDI_rxEvent(HAL_UART_RXEVENT_TC, MIDI_BUFF_SIZE);
+#endif
+	}
+	if (__HAL_DMA_GET_FLAG(hdma, __HAL_DMA_GET_TE_FLAG_INDEX(hdma))) {
+		__HAL_DMA_CLEAR_FLAG(hdma, __HAL_DMA_GET_TE_FLAG_INDEX(hdma));
+		MIDI_rx_stopped = 1; //the stream has stopped; MIDI_check starts it again
+	}
+#if defined(DMA_SxCR_DMEIE)
+	// FIFO and direct mode errors don't stop the stream, but their interrupts fire until acknowledged
+	__HAL_DMA_CLEAR_FLAG(hdma, __HAL_DMA_GET_FE_FLAG_INDEX(hdma) | __HAL_DMA_GET_DME_FLAG_INDEX(hdma));
+#endif
+}
+#else
+/* MIDI_DATA_RX
+ * @brief 	A "MIDI data received" callback, called by the HAL. Check the Rx status and set flags.
+ * @param 	huart		The handle of the UART that received data and called the callback.
+ * @param	Size		The size/amount of data that is received/valid.
+ */
+static void MIDI_DATA_RX(UART_HandleTypeDef* huart, uint16_t Size)
+{
+	if (huart->Instance == MIDI_uart->Instance) {
+		MIDI_rxEvent(huart->RxEventType, Size);
+	}
+}
+
+/* MIDI_UART_ERROR
+ * @brief 	A UART error callback, called by the HAL. Line errors that made the HAL abort the DMA
+ * 			reception (an overrun, or a DMA error) leave the UART out of reception: flag it for MIDI_check.
+ * @param 	huart		The handle of the UART that had the error.
+ */
+static void MIDI_UART_ERROR(UART_HandleTypeDef* huart)
+{
+	if ((huart->Instance == MIDI_uart->Instance) && (huart->RxState != HAL_UART_STATE_BUSY_RX)) {
+		MIDI_rx_stopped = 1;
+	}
+}
+#endif
+
+#if MIDI_STUCK_NOTES
+/* MIDI_noteDuration
+ * @brief 	A held note is released: count its duration in the histogram.
+ * @param	channel		The MIDI channel of the note, between 0 and 15.
+ * @param	note_num	The 7-bit note number.
+ */
+static void MIDI_noteDuration(uint8_t channel, uint8_t note_num) {
+	uint32_t bit = 1UL << (note_num & 0x1F);
+	uint8_t bucket = MIDI_DURATION_BUCKETS - 1;
+	if (MIDI_notes_stuck[channel][note_num >> 5] & bit) {
+		MIDI_notes_stuck[channel][note_num >> 5] &= ~bit; //held past the timeout: its 16-bit time may have wrapped
+	}
+	else {
+		uint16_t held = (uint16_t)HAL_GetTick() - MIDI_note_on_tick[channel][note_num];
+		for (uint8_t n = 1; n < MIDI_DURATION_BUCKETS; n++) {
+			if (held < (1UL << n)) {
+				bucket = n - 1;
+				break;
+			}
+		}
+	}
+	MIDI_note_durations[bucket]++;
+}
+#endif
+
+/* MIDI_trackNoteOn / MIDI_trackNoteOff / MIDI_trackChannelOff
+ * @brief 	Keep the held-note bitmaps in step with the note messages passed to the user callbacks.
+ * @param	channel		The MIDI channel of the note, between 0 and 15.
+ * @param	note_num	The 7-bit note number.
+ */
+static void MIDI_trackNoteOn(uint8_t channel, uint8_t note_num) {
+#if MIDI_NOTE_TRACKING
+	uint32_t bit = 1UL << (note_num & 0x1F);
+	if (!(MIDI_notes_held[channel][note_num >> 5] & bit)) {
+		MIDI_notes_held[channel][note_num >> 5] |= bit;
+		MIDI_notes_held_count[channel]++;
+	}
+#if MIDI_STUCK_NOTES
+	else {
+		MIDI_noteDuration(channel, note_num); //struck again without a note-off: the earlier strike ends here
+	}
+#endif
+#endif
+#if MIDI_STUCK_NOTES
+	MIDI_note_on_tick[channel][note_num] = (uint16_t)HAL_GetTick();
+	MIDI_notes_stuck[channel][note_num >> 5] &= ~bit;
+#endif
+#if MIDI_HELD_NOTES
+	if (MIDI_held_sets[channel] != NULL) {
+		MIDI_heldInsert(MIDI_held_sets[channel], note_num);
+	}
+#endif
+}
+
+static void MIDI_trackNoteOff(uint8_t channel, uint8_t note_num) {
+#if MIDI_NOTE_TRACKING
+	uint32_t bit = 1UL << (note_num & 0x1F);
+	if (MIDI_notes_held[channel][note_num >> 5] & bit) {
+		MIDI_notes_held[channel][note_num >> 5] &= ~bit;
+		MIDI_notes_held_count[channel]--;
+#if MIDI_STUCK_NOTES
+		MIDI_noteDuration(channel, note_num);
+#endif
+	}
+#endif
+#if MIDI_HELD_NOTES
+	if (MIDI_held_sets[channel] != NULL) {
+		MIDI_heldRemove(MIDI_held_sets[channel], note_num);
+	}
+#endif
+}
+
+static void MIDI_trackChannelOff(uint8_t channel) {
+#if MIDI_NOTE_TRACKING
+#if MIDI_STUCK_NOTES
+	for (uint8_t word = 0; word < 4; word++) {
+		for (uint32_t held = MIDI_notes_held[channel][word]; held != 0; held &= held - 1) {
+			MIDI_noteDuration(channel, (word << 5) | __builtin_ctz(held));
+		}
+	}
+#endif
+	memset(MIDI_notes_held[channel], 0, sizeof(MIDI_notes_held[channel]));
+	MIDI_notes_held_count[channel] = 0;
+#endif
+#if MIDI_HELD_NOTES
+	if (MIDI_held_sets[channel] != NULL) {
+		MIDI_heldClear(MIDI_held_sets[channel]);
+	}
+#endif
+}
+
+#if MIDI_MTS
+/* MIDI_mtsPitch
+ * @brief 	Converts a (fractional) MIDI note number to the stored pitch representation.
+ * @param	note		The note number, 69.0 being A4 = 440Hz.
+ */
+static MIDI_Pitch MIDI_mtsPitch(float note) {
+	float hz = 440.0f * exp2f((note - 69.0f) / 12.0f);
+#ifdef MIDI_MTS_SAMPLE_RATE
+	float increment = hz * (4294967296.0f / MIDI_MTS_SAMPLE_RATE);
+	return (increment >= 4294967296.0f) ? 0xFFFFFFFFUL : (MIDI_Pitch)increment; //at or above the sample rate: doesn't fit
+#else
+	return hz;
+#endif
+}
+
+/* MIDI_mtsEdit
+ * @brief 	Starts editing the back tables of some channels, seeding them from the live tables. The
+ * 			back table is the one that is neither live nor held by the audio side, so a reader still
+ * 			working from a table a swap has retired never sees it change.
+ * @param	channels	The channels (bitmask, bit 0 = channel 1) the current message changes.
+ */
+static void MIDI_mtsEdit(uint16_t channels) {
+	for (uint8_t ch = 0; ch < 16; ch++) {
+		if ((channels & ~MIDI_mts_edit) & (1 << ch)) {
+			uint8_t front = MIDI_tuning_front[ch];
+			uint8_t held = MIDI_tuning_held[ch];
+			MIDI_tuning_back[ch] = (held != front) ? (3 - front - held) : ((front + 1) % 3);
+			memcpy(MIDI_tuning[ch][MIDI_tuning_back[ch]], MIDI_tuning[ch][front], sizeof(MIDI_tuning[ch][0]));
+		}
+	}
+	MIDI_mts_edit |= channels;
+}
+
+/* MIDI_mtsSetNote
+ * @brief 	Applies an MTS frequency word (semitone + 14-bit fraction) to one note of the edited tables.
+ */
+static void MIDI_mtsSetNote(uint8_t note, uint8_t xx, uint8_t yy, uint8_t zz) {
+	if ((xx == 0x7F) && (yy == 0x7F) && (zz == 0x7F)) {
+		return; //"no change"
+	}
+	MIDI_Pitch pitch = MIDI_mtsPitch(xx + ((yy << 7) | zz) / 16384.0f);
+	for (uint8_t ch = 0; ch < 16; ch++) {
+		if (MIDI_mts_edit & (1 << ch)) {
+			MIDI_tuning[ch][MIDI_tuning_back[ch]][note] = pitch;
+		}
+	}
+	MIDI_mts_ready = 1;
+}
+
+/* MIDI_mtsSetScale
+ * @brief 	Fills the edited tables from twelve per-pitch-class offsets, in cents.
+ */
+static void MIDI_mtsSetScale(const float* cents) {
+	for (uint8_t note = 0; note < 128; note++) {
+		MIDI_Pitch pitch = MIDI_mtsPitch(note + cents[note % 12] / 100.0f);
+		for (uint8_t ch = 0; ch < 16; ch++) {
+			if (MIDI_mts_edit & (1 << ch)) {
+				MIDI_tuning[ch][MIDI_tuning_back[ch]][note] = pitch;
+			}
+		}
+	}
+	MIDI_mts_ready = 1;
+}
+#endif
+
+/* MIDI_sysexStart / MIDI_sysexData / MIDI_sysexEnd
+ * @brief 	Follow a SysEx message byte by byte (it is never staged as a whole). Used to decode MIDI
+ * 			Tuning Standard messages into the pitch tables.
+ * @param	data		A SysEx data byte.
+ * @param	complete	Whether the message was terminated by EOX (0xF7) rather than cut short.
+ */
+static void MIDI_sysexStart() {
+#if MIDI_MTS
+	MIDI_sysex_count = 0;
+	MIDI_mts_format = 0;
+	MIDI_mts_ready = 0;
+	MIDI_mts_edit = 0;
+#endif
+}
+
+static void MIDI_sysexData(uint8_t data) {
+#if MIDI_MTS
+	uint16_t i = MIDI_sysex_count;
+	if (i < 0xFFFF) {
+		MIDI_sysex_count++;
+	}
+	if (i < 4) {
+		// HEADER: F0 7E/7F <device> 08 <sub-id>, any device ID is accepted
+		MIDI_mts_bytes[i] = data;
+		if (i == 3) {
+			uint8_t realtime = (MIDI_mts_bytes[0] == 0x7F);
+			MIDI_mts_format = 0;
+			if (((MIDI_mts_bytes[0] == 0x7E) || realtime) && (MIDI_mts_bytes[2] == 0x08)) {
+				if (((data == MIDI_MTS_BULK_DUMP) && !realtime) || ((data == MIDI_MTS_NOTE_CHANGE) && realtime) ||
+						(data == MIDI_MTS_BANK_NOTE_CHANGE) || (data == MIDI_MTS_SCALE_1BYTE) || (data == MIDI_MTS_SCALE_2BYTE)) {
+					MIDI_mts_format = data;
+				}
+			}
+			MIDI_mts_checksum = MIDI_mts_bytes[0] ^ MIDI_mts_bytes[1] ^ MIDI_mts_bytes[2] ^ data;
+		}
+		return;
+	}
+	if (MIDI_mts_format == MIDI_MTS_BULK_DUMP) {
+		// <program> <name x16> [<xx> <yy> <zz>] x128 <checksum>, applies to every channel
+		if (i < 405) {
+			MIDI_mts_checksum ^= data;
+			if (i == 4) {
+				MIDI_mtsEdit(0xFFFF);
+			}
+			else if (i >= 21) {
+				uint8_t k = (i - 21) % 3;
+				MIDI_mts_bytes[k] = data;
+				if (k == 2) {
+					MIDI_mtsSetNote((i - 21) / 3, MIDI_mts_bytes[0], MIDI_mts_bytes[1], MIDI_mts_bytes[2]);
+				}
+			}
+			MIDI_mts_ready = 0; //only a dump with a valid checksum goes live
+		}
+		else if (i == 405) {
+			MIDI_mts_ready = ((MIDI_mts_checksum & 0x7F) == data);
+		}
+	}
+	else if ((MIDI_mts_format == MIDI_MTS_NOTE_CHANGE) || (MIDI_mts_format == MIDI_MTS_BANK_NOTE_CHANGE)) {
+		// [<bank>] <program> <count> [<note> <xx> <yy> <zz>] x count, applies to every channel
+		uint8_t first = (MIDI_mts_format == MIDI_MTS_NOTE_CHANGE) ? 6 : 7;
+		if (i == first - 1) {
+			MIDI_mts_bytes[4] = data; //number of changes
+			MIDI_mtsEdit(0xFFFF);
+		}
+		else if ((i >= first) && ((i - first) / 4 < MIDI_mts_bytes[4])) {
+			uint8_t k = (i - first) % 4;
+			MIDI_mts_bytes[k] = data;
+			if (k == 3) {
+				MIDI_mtsSetNote(MIDI_mts_bytes[0], MIDI_mts_bytes[1], MIDI_mts_bytes[2], MIDI_mts_bytes[3]);
+			}
+		}
+	}
+	else if ((MIDI_mts_format == MIDI_MTS_SCALE_1BYTE) || (MIDI_mts_format == MIDI_MTS_SCALE_2BYTE)) {
+		// <ff> <gg> <hh> (channel bitmask) [<ss>] or [<ss> <tt>] x12
+		uint8_t length = (MIDI_mts_format == MIDI_MTS_SCALE_1BYTE) ? 12 : 24;
+		if (i < 7) {
+			MIDI_mts_bytes[i - 4] = data;
+			if (i == 6) {
+				MIDI_mtsEdit(MIDI_mts_bytes[2] | (MIDI_mts_bytes[1] << 7) | ((MIDI_mts_bytes[0] & 0x03) << 14));
+			}
+		}
+		else if (i < 7 + length) {
+			MIDI_mts_bytes[i - 7] = data;
+			if (i == 6 + length) {
+				float cents[12];
+				for (uint8_t pc = 0; pc < 12; pc++) {
+					if (MIDI_mts_format == MIDI_MTS_SCALE_1BYTE) {
+						cents[pc] = (int8_t)(MIDI_mts_bytes[pc] - 64); //0x40 = 0 cents, 1 cent steps
+					}
+					else {
+						cents[pc] = (((MIDI_mts_bytes[2 * pc] << 7) | MIDI_mts_bytes[2 * pc + 1]) - 8192) * (100.0f / 8192.0f);
+					}
+				}
+				MIDI_mtsSetScale(cents);
+			}
+		}
+	}
+#endif
+}
+
+static void MIDI_sysexEnd(uint8_t complete) {
+#if MIDI_MTS
+	if (complete && MIDI_mts_ready) {
+		// TUNING CHANGE COMPLETE: make the edited tables live, one byte write per channel
+		for (uint8_t ch = 0; ch < 16; ch++) {
+			if (MIDI_mts_edit & (1 << ch)) {
+				MIDI_tuning_front[ch] = MIDI_tuning_back[ch];
+			}
+		}
+	}
+	MIDI_mts_edit = 0;
+	MIDI_mts_format = 0;
+#endif
+}
+
+#if MIDI_PROFILING
+#if !defined(DWT_CTRL_CYCCNTENA_Msk)
+#error "MIDI_PROFILING needs the DWT cycle counter (Cortex-M3 and up)"
+#endif
+
+MIDI_Profile MIDI_profile; //time accounting since MIDI_init or MIDI_resetProfile
+uint32_t MIDI_profile_budget; //handler budget in cycles (0: none)
+uint32_t MIDI_profile_in_handlers; //cycles spent in handlers during the current MIDI_check
+
+/* MIDI_profileHandler
+ * @brief 	Books the cycles of one handler call and reports it if it went over the budget.
+ */
+static void MIDI_profileHandler(uint8_t msg, uint8_t channel, uint32_t cycles) {
+	MIDI_HandlerProfile* handler = &MIDI_profile.handlers[msg];
+	handler->calls++;
+	handler->cycles += cycles;
+	if (cycles > handler->max_cycles) {
+		handler->max_cycles = cycles;
+	}
+	MIDI_profile_in_handlers += cycles;
+	if ((MIDI_profile_budget != 0) && (cycles > MIDI_profile_budget)) {
+		handler->overruns++;
+		MIDI_handlerOverrun((MIDI_MsgClass)msg, channel, cycles);
+	}
+}
+#endif
+
+/* MIDI_callHandler
+ * @brief 	Calls the handler of a message: its handler table entry, or the global callback.
+ */
+static void MIDI_callHandler(uint8_t msg, uint8_t channel, uint8_t data1, uint8_t data2) {
+#if MIDI_CHANNEL_HANDLERS
+	MIDI_HandlerEntry* entry = &MIDI_handlers[channel][msg];
+	if (entry->handler != NULL) {
+		entry->handler(entry->context, channel, data1, data2);
+		return;
+	}
+#endif
+	if (msg == MIDI_MSG_NOTE_OFF) {
+		MIDI_noteOff(data1, data2);
+	}
+	else if (msg == MIDI_MSG_NOTE_ON) {
+		MIDI_noteOn(data1, data2);
+	}
+	else if (msg == MIDI_MSG_CC) {
+		MIDI_CC(data1, data2);
+	}
+	else if (msg == MIDI_MSG_PITCH_BEND) {
+		MIDI_pitchBend((data1 | (data2 << 7)) - 8192);
+	}
+	else {
+		//no global callback for this message. ignore! :)
+	}
+}
+
+/* MIDI_deliver
+ * @brief 	Hands a decoded channel message to its handler: the one registered for this channel and
+ * 			message class with MIDI_setHandler if there is one, otherwise the global callback.
+ * @param	msg			The message class (MIDI_MSG_...).
+ * @param	channel		The MIDI channel of the message, between 0 and 15.
+ * @param	data1		First data byte (note/control/program number, pitchbend LSB).
+ * @param	data2		Second data byte (velocity/value/pitchbend MSB), 0 for one-byte messages.
+ */
+static void MIDI_deliver(uint8_t msg, uint8_t channel, uint8_t data1, uint8_t data2) {
+	if (msg == MIDI_MSG_NOTE_OFF) {
+		MIDI_trackNoteOff(channel, data1);
+	}
+	else if (msg == MIDI_MSG_NOTE_ON) {
+		MIDI_trackNoteOn(channel, data1);
+	}
+	else if ((msg == MIDI_MSG_CC) && ((data1 == 120) || (data1 == 123))) {
+		// ALL SOUND OFF / ALL NOTES OFF: the sender has released everything on this channel
+		MIDI_trackChannelOff(channel);
+	}
+#if MIDI_PROFILING
+	uint32_t start = DWT->CYCCNT;
+	MIDI_callHandler(msg, channel, data1, data2);
+	MIDI_profileHandler(msg, channel, DWT->CYCCNT - start);
+#else
+	MIDI_callHandler(msg, channel, data1, data2);
+#endif
+}
+
+#if MIDI_STUCK_NOTES
+/* MIDI_stuckRetrigger
+ * @brief 	Checks a note-on against the held notes: a note that is still held (and not just ringing
+ * 			under a pedal) missed its note-off. Reports it, and sends the note-off if asked to.
+ * @param	channel		The MIDI channel of the note, between 0 and 15.
+ * @param	note_num	The 7-bit note number.
+ */
+static void MIDI_stuckRetrigger(uint8_t channel, uint8_t note_num) {
+	uint32_t bit = 1UL << (note_num & 0x1F);
+	uint32_t held = MIDI_notes_held[channel][note_num >> 5];
+#if MIDI_PEDALS
+	held &= ~MIDI_pedal_deferred[channel][note_num >> 5];
+#endif
+	if ((held & bit) && !(MIDI_notes_stuck[channel][note_num >> 5] & bit)) {
+		uint16_t held_ms = (uint16_t)HAL_GetTick() - MIDI_note_on_tick[channel][note_num];
+		if (MIDI_stuckNote(channel, note_num, MIDI_STUCK_RETRIGGER, held_ms)) {
+			MIDI_deliver(MIDI_MSG_NOTE_OFF, channel, note_num, 0);
+		}
+	}
+}
+
+/* MIDI_stuckScan
+ * @brief 	Reports the notes held longer than MIDI_STUCK_NOTE_TIMEOUT, once each, and sends their
+ * 			note-off if asked to. Notes held by a pedal aren't reported, only marked, so that their
+ * 			duration lands in the last bucket even if their 16-bit note-on time wraps. Run from
+ * 			MIDI_check.
+ */
+static void MIDI_stuckScan() {
+	uint32_t now = HAL_GetTick();
+	if ((now - MIDI_stuck_scan_tick) < MIDI_STUCK_SCAN_INTERVAL) {
+		return;
+	}
+	MIDI_stuck_scan_tick = now;
+	for (uint8_t ch = 0; ch < 16; ch++) {
+		if (MIDI_notes_held_count[ch] == 0) {
+			continue;
+		}
+		for (uint8_t word = 0; word < 4; word++) {
+			uint32_t held = MIDI_notes_held[ch][word] & ~MIDI_notes_stuck[ch][word];
+			uint32_t ringing = 0;
+#if MIDI_PEDALS
+			ringing = MIDI_pedal_deferred[ch][word];
+#endif
+			for (; held != 0; held &= held - 1) {
+				uint8_t note = (word << 5) | __builtin_ctz(held);
+				uint16_t held_ms = (uint16_t)now - MIDI_note_on_tick[ch][note];
+				if (held_ms >= MIDI_STUCK_NOTE_TIMEOUT) {
+					MIDI_notes_stuck[ch][word] |= 1UL << (note & 0x1F);
+					if (ringing & (1UL << (note & 0x1F))) {
+						continue; //held by a pedal: not stuck, just long
+					}
+					if (MIDI_stuckNote(ch, note, MIDI_STUCK_TIMEOUT, held_ms)) {
+						MIDI_deliver(MIDI_MSG_NOTE_OFF, ch, note, 0);
+					}
+				}
+			}
+		}
+	}
+}
+
+/* MIDI_getNoteDurations
+ * @brief 	Copies the note duration histogram: histogram[n] is the number of notes held between 2^n
+ * 			and 2^(n+1) ms (bucket 0 also counts shorter ones). The last bucket also counts every note
+ * 			held past MIDI_STUCK_NOTE_TIMEOUT (stuck or held by a pedal), however long it was held.
+ * @param	histogram	Where to store the MIDI_DURATION_BUCKETS counts.
+ */
+void MIDI_getNoteDurations(uint32_t* histogram) {
+	memcpy(histogram, MIDI_note_durations, sizeof(MIDI_note_durations));
+}
+
+/* MIDI_resetNoteDurations
+ * @brief 	Clears the note duration histogram.
+ */
+void MIDI_resetNoteDurations() {
+	memset(MIDI_note_durations, 0, sizeof(MIDI_note_durations));
+}
+#endif
+
+#if MIDI_PEDALS
+/* MIDI_pedalRelease
+ * @brief 	Delivers the note-offs a pedal was holding back, except those the other pedal still holds.
+ * @param	channel		The MIDI channel, between 0 and 15.
+ */
+static void MIDI_pedalRelease(uint8_t channel) {
+	for (uint8_t word = 0; word < 4; word++) {
+		uint32_t release = MIDI_pedal_deferred[channel][word];
+		if (MIDI_pedal_sustain & (1 << channel)) {
+			release = 0; //sustain still holds everything
+		}
+		else if (MIDI_pedal_sostenuto & (1 << channel)) {
+			release &= ~MIDI_pedal_latched[channel][word];
+		}
+		MIDI_pedal_deferred[channel][word] &= ~release;
+		while (release) {
+			uint8_t bit = __builtin_ctz(release);
+			release &= release - 1;
+			MIDI_deliver(MIDI_MSG_NOTE_OFF, channel, (word << 5) | bit, 0);
+		}
+	}
+}
+
+/* MIDI_pedalClear
+ * @brief 	Forgets the notes the pedals of a channel are holding (they are being released anyway).
+ * @param	channel		The MIDI channel, between 0 and 15.
+ * @param	pedals		Whether the pedals go up too; All Notes Off / All Sound Off leave them down.
+ */
+static void MIDI_pedalClear(uint8_t channel, uint8_t pedals) {
+	if (pedals) {
+		MIDI_pedal_sustain &= ~(1 << channel);
+		MIDI_pedal_sostenuto &= ~(1 << channel);
+	}
+	memset(MIDI_pedal_deferred[channel], 0, sizeof(MIDI_pedal_deferred[channel]));
+	memset(MIDI_pedal_latched[channel], 0, sizeof(MIDI_pedal_latched[channel]));
+}
+#endif
+
+#if MIDI_PRESETS
+/* MIDI_presetInUse
+ * @brief 	Whether a cache slot must be kept: some channel plays from it, another channel waits for it,
+ * 			or its data is still being loaded (MIDI_presetLoaded would mark the next preset ready).
+ */
+static uint8_t MIDI_presetInUse(uint8_t slot, uint8_t channel) {
+	if ((MIDI_preset_ids[slot] != MIDI_PRESET_NONE) && !MIDI_preset_ready[slot]) {
+		return 1;
+	}
+	for (uint8_t ch = 0; ch < 16; ch++) {
+		if ((MIDI_preset_active[ch] == slot) || ((ch != channel) && (MIDI_preset_pending[ch] == slot))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* MIDI_presetNotify
+ * @brief 	Calls MIDI_presetChange, accounted (MIDI_PROFILING) like a handler of the program change
+ * 			behind it.
+ */
+static void MIDI_presetNotify(uint8_t channel, uint16_t bank, uint8_t program, uint8_t slot) {
+#if MIDI_PROFILING
+	uint32_t start = DWT->CYCCNT;
+	MIDI_presetChange(channel, bank, program, slot);
+	MIDI_profileHandler(MIDI_MSG_PROGRAM_CHANGE, channel, DWT->CYCCNT - start);
+#else
+	MIDI_presetChange(channel, bank, program, slot);
+#endif
+}
+
+/* MIDI_presetCommit
+ * @brief 	Switches a channel to the preset it was waiting for, now that its slot is filled.
+ */
+static void MIDI_presetCommit(uint8_t channel) {
+	uint8_t slot = MIDI_preset_pending[channel];
+	uint32_t id = MIDI_preset_ids[slot];
+	MIDI_preset_pending[channel] = MIDI_PRESET_NO_SLOT;
+	MIDI_preset_waiting &= ~(1 << channel);
+	MIDI_preset_active[channel] = slot;
+	MIDI_presetNotify(channel, id >> 7, id & 0x7F, slot);
+}
+
+/* MIDI_presetRequest
+ * @brief 	Turns a program change (plus the last bank select) into a preset change. A preset still in
+ * 			the cache is switched to at once. Otherwise the least recently used slot that no channel
+ * 			needs (and isn't still loading) is handed to MIDI_presetLoad, and MIDI_check commits the
+ * 			change once MIDI_presetLoaded reports the slot as filled.
+ * @param	channel		The MIDI channel, between 0 and 15.
+ * @param	program		The 7-bit program number.
+ */
+static void MIDI_presetRequest(uint8_t channel, uint8_t program) {
+	uint16_t bank = (MIDI_bank_msb[channel] << 7) | MIDI_bank_lsb[channel];
+	uint32_t id = ((uint32_t)bank << 7) | program;
+	uint8_t pos = 0;
+	while ((pos < MIDI_PRESET_CACHE_SLOTS) && (MIDI_preset_ids[MIDI_preset_lru[pos]] != id)) {
+		pos++;
+	}
+	if (pos == MIDI_PRESET_CACHE_SLOTS) {
+		// CACHE MISS: reuse the least recently used slot no channel needs
+		do {
+			pos--;
+		} while ((pos > 0) && MIDI_presetInUse(MIDI_preset_lru[pos], channel));
+		if (MIDI_presetInUse(MIDI_preset_lru[pos], channel)) {
+			// every slot is taken, so there is nowhere to prefetch to: let the app load it directly
+			MIDI_preset_pending[channel] = MIDI_PRESET_NO_SLOT;
+			MIDI_preset_waiting &= ~(1 << channel);
+			MIDI_preset_active[channel] = MIDI_PRESET_NO_SLOT; //its old slot is no longer in use
+			MIDI_presetNotify(channel, bank, program, MIDI_PRESET_NO_SLOT);
+			return;
+		}
+	}
+	uint8_t slot = MIDI_preset_lru[pos];
+	while (pos > 0) {
+		MIDI_preset_lru[pos] = MIDI_preset_lru[pos - 1]; //move the slot to the front of the LRU order
+		pos--;
+	}
+	MIDI_preset_lru[0] = slot;
+	MIDI_preset_pending[channel] = slot;
+	MIDI_preset_waiting |= 1 << channel;
+	if (MIDI_preset_ids[slot] != id) {
+		MIDI_preset_ids[slot] = id;
+		MIDI_preset_ready[slot] = 0;
+#if MIDI_PROFILING
+		uint32_t start = DWT->CYCCNT;
+		MIDI_presetLoad(slot, bank, program); //start fetching the preset data now
+		MIDI_profileHandler(MIDI_MSG_PROGRAM_CHANGE, channel, DWT->CYCCNT - start);
+#else
+		MIDI_presetLoad(slot, bank, program); //start fetching the preset data now
+#endif
+	}
+	if (MIDI_preset_ready[slot]) {
+		MIDI_presetCommit(channel);
+	}
+}
+#endif
+
+/* MIDI_dispatch
+ * @brief 	Passes a channel message through the sustain/sostenuto pedal resolver (if enabled) and
+ * 			on to MIDI_deliver. Note-offs of notes held by a pedal are held back until it is lifted.
+ * @param	msg			The message class (MIDI_MSG_...).
+ * @param	channel		The MIDI channel of the message, between 0 and 15.
+ * @param	data1		First data byte.
+ * @param	data2		Second data byte, 0 for one-byte messages.
+ */
+static void MIDI_dispatch(uint8_t msg, uint8_t channel, uint8_t data1, uint8_t data2) {
+#if MIDI_STUCK_NOTES
+	if (msg == MIDI_MSG_NOTE_ON) {
+		MIDI_stuckRetrigger(channel, data1); //before the pedals: a note struck again under a pedal isn't stuck
+	}
+#endif
+#if MIDI_PEDALS
+	uint16_t channel_bit = 1 << channel;
+	uint32_t note_bit = 1UL << (data1 & 0x1F);
+	uint8_t release = 0;
+	if (msg == MIDI_MSG_NOTE_ON) {
+		MIDI_pedal_deferred[channel][data1 >> 5] &= ~note_bit; //struck again: no longer just ringing
+	}
+	else if (msg == MIDI_MSG_NOTE_OFF) {
+		if ((MIDI_pedal_sustain & channel_bit) || (MIDI_pedal_latched[channel][data1 >> 5] & note_bit)) {
+			MIDI_pedal_deferred[channel][data1 >> 5] |= note_bit; //held by a pedal: release later
+			return;
+		}
+	}
+	else if ((msg == MIDI_MSG_CC) && (data1 == 64)) {
+		// SUSTAIN (DAMPER) PEDAL
+		if (data2 >= 64) {
+			MIDI_pedal_sustain |= channel_bit;
+		}
+		else if (MIDI_pedal_sustain & channel_bit) {
+			MIDI_pedal_sustain &= ~channel_bit;
+			release = 1;
+		}
+	}
+	else if ((msg == MIDI_MSG_CC) && (data1 == 66)) {
+		// SOSTENUTO PEDAL: only holds the notes whose keys are down when it is pressed
+		if ((data2 >= 64) && !(MIDI_pedal_sostenuto & channel_bit)) {
+			MIDI_pedal_sostenuto |= channel_bit;
+			for (uint8_t word = 0; word < 4; word++) {
+				MIDI_pedal_latched[channel][word] = MIDI_notes_held[channel][word] & ~MIDI_pedal_deferred[channel][word];
+			}
+		}
+		else if ((data2 < 64) && (MIDI_pedal_sostenuto & channel_bit)) {
+			MIDI_pedal_sostenuto &= ~channel_bit;
+			release = 1;
+		}
+	}
+	else if ((msg == MIDI_MSG_CC) && (data1 == 121)) {
+		// RESET ALL CONTROLLERS: both pedals go up
+		release = (((MIDI_pedal_sustain | MIDI_pedal_sostenuto) & channel_bit) != 0);
+		MIDI_pedal_sustain &= ~channel_bit;
+		MIDI_pedal_sostenuto &= ~channel_bit;
+	}
+	else if ((msg == MIDI_MSG_CC) && ((data1 == 120) || (data1 == 123))) {
+		MIDI_pedalClear(channel, 0); //the notes go, but a pedal still down keeps holding the next ones
+	}
+#endif
+#if MIDI_PRESETS
+	if ((msg == MIDI_MSG_CC) && (data1 == 0)) {
+		MIDI_bank_msb[channel] = data2; //BANK SELECT MSB
+	}
+	else if ((msg == MIDI_MSG_CC) && (data1 == 32)) {
+		MIDI_bank_lsb[channel] = data2; //BANK SELECT LSB
+	}
+	else if (msg == MIDI_MSG_PROGRAM_CHANGE) {
+		MIDI_presetRequest(channel, data1);
+		return;
+	}
+#endif
+	MIDI_deliver(msg, channel, data1, data2);
+#if MIDI_PEDALS
+	if (release) {
+		// a pedal was lifted: let go of the notes it was holding, after the pedal message itself
+		MIDI_pedalRelease(channel);
+		if (!(MIDI_pedal_sostenuto & channel_bit)) {
+			memset(MIDI_pedal_latched[channel], 0, sizeof(MIDI_pedal_latched[channel]));
+		}
+	}
+#endif
+}
+
+/* MIDI_parse
+ * @brief 	Takes the completed MIDI command and interprets it, issuing the associated callback.
+ */
+static void MIDI_parse() {
+	// What type of message did we receive? (Check status byte value.)
+	uint8_t status_msb = MIDI_cmd_stage[0] >> 4;
+	uint8_t status_lsb = MIDI_cmd_stage[0] & 0xF;
+	MIDI_cmd_state = 0; //reset buffer index in case of running status
+	if ((status_msb < 0x8) || (status_msb > 0xE)) {
+		//system common message: not supported, and it cancels running status. ignore! :)
+		MIDI_message_length = 0xFF;
+		return;
+	}
+	if ((MIDI_channel != MIDI_CHANNEL_ALL) && (status_lsb != MIDI_channel)) {
+		//not the correct MIDI channel. ignore! :)
+		return;
+	}
+	// The message class is the status nibble minus 8, so it indexes the handler table directly.
+	uint8_t msg = status_msb - 0x8;
+	uint8_t data1 = MIDI_cmd_stage[1] & 0x7F;
+	uint8_t data2 = (MIDI_message_length == 2) ? (MIDI_cmd_stage[2] & 0x7F) : 0;
+#if MIDI_FILTER_RULES
+	const MIDI_FilterTable* filter = MIDI_filter;
+	if (filter != NULL) {
+		// rules match the status as sent, so a velocity-0 note-off goes wherever its note-on went
+		uint8_t action = filter->status[status_lsb][msg];
+		if ((action & 0x80) && (action != MIDI_RULE_DROP)) {
+			action = filter->data[action & 0x7F][data1]; //outcome depends on the note/controller number
+		}
+		if (action == MIDI_RULE_DROP) {
+			//filtered out by a rule. ignore! :)
+			return;
+		}
+		if (action != MIDI_FILTER_PASS) {
+			status_lsb = action; //deliver on the channel the rules route it to
+		}
+	}
+#endif
+	if ((msg == MIDI_MSG_NOTE_ON) && (data2 == 0)) {
+		// note_on velocity is 0 --> use Implicit Note Off
+		msg = MIDI_MSG_NOTE_OFF;
+	}
+#if MIDI_ZONES
+	uint8_t keyed = (msg == MIDI_MSG_NOTE_OFF) || (msg == MIDI_MSG_NOTE_ON) || (msg == MIDI_MSG_POLY_PRESSURE);
+	uint8_t zones = keyed ? MIDI_zone_map[status_lsb][data1] : MIDI_zone_inputs[status_lsb];
+	if (zones != 0) {
+		// SPLIT/LAYER: play the message in every zone this key (or channel) belongs to
+		while (zones) {
+			const MIDI_Zone* zone = &MIDI_zones[__builtin_ctz(zones)];
+			zones &= zones - 1;
+			if (!keyed) {
+				MIDI_dispatch(msg, zone->channel - 1, data1, data2);
+				continue;
+			}
+			int16_t note = data1 + zone->transpose;
+			if ((note < 0) || (note > 127)) {
+				continue; //transposed out of range
+			}
+			uint8_t value = data2;
+			if (msg == MIDI_MSG_NOTE_ON) {
+				uint16_t velocity = (data2 * zone->velocity_scale + 32) >> 6;
+				value = (velocity < 1) ? 1 : (velocity > 127) ? 127 : velocity; //a note-on must stay a note-on
+			}
+			MIDI_dispatch(msg, zone->channel - 1, note, value);
+		}
+		return;
+	}
+#endif
+	MIDI_dispatch(msg, status_lsb, data1, data2);
+}
+
+#if MIDI_CHANNEL_HANDLERS
+/* MIDI_setHandler
+ * @brief 	Registers a handler for one message class on one MIDI channel (or on all of them). Can be
+ * 			called at any time, even if MIDI_check runs in an interrupt.
+ * @param	channel		The MIDI channel, between 1 and 16, or MIDI_CHANNEL_ALL.
+ * @param	msg			The message class (MIDI_MSG_...).
+ * @param	handler		The function to call, or NULL to go back to the global callback.
+ * @param	context		Passed to the handler as-is, e.g. a pointer to the synth part.
+ */
+void MIDI_setHandler(uint8_t channel, MIDI_MsgClass msg, MIDI_Handler handler, void* context) {
+	if (msg >= MIDI_MSG_COUNT) {
+		return;
+	}
+	for (uint8_t ch = 0; ch < 16; ch++) {
+		if ((channel == MIDI_CHANNEL_ALL) || (channel == ch + 1)) {
+			// both fields at once, so that MIDI_check (e.g. run from an interrupt) never pairs a
+			// handler with the wrong context
+			uint32_t primask = __get_PRIMASK();
+			__disable_irq();
+			MIDI_handlers[ch][msg].handler = handler;
+			MIDI_handlers[ch][msg].context = context;
+			__set_PRIMASK(primask);
+		}
+	}
+}
+#endif
+
+#if MIDI_FILTER_RULES
+/* MIDI_compileRules
+ * @brief 	Compiles a list of rules into a MIDI_FilterTable. For every channel and message class this
+ * 			works out the first matching rule; where that depends on the note/controller number, the
+ * 			outcome for all 128 numbers goes into a data table. Table entries say "pass unchanged"
+ * 			rather than naming the source channel, so channels with the same rules share a table.
+ * @param	table		The table to fill.
+ * @param	rules		The rules, in priority order (the first matching rule wins).
+ * @param	count		Number of rules.
+ * @retval	HAL_OK, or HAL_ERROR if a rule is invalid (out of range, or an empty channel or data
+ * 			range) or the data tables run out.
+ */
+HAL_StatusTypeDef MIDI_compileRules(MIDI_FilterTable* table, const MIDI_Rule* rules, uint8_t count) {
+	uint8_t row[128];
+	table->data_used = 0;
+	for (uint8_t r = 0; r < count; r++) {
+		if ((rules[r].channel_lo < 1) || (rules[r].channel_hi > 16) || (rules[r].channel_lo > rules[r].channel_hi) ||
+				(rules[r].data_lo > rules[r].data_hi) ||
+				((rules[r].action != MIDI_RULE_DROP) && ((rules[r].action < 1) || (rules[r].action > 16)))) {
+			return HAL_ERROR;
+		}
+	}
+	for (uint8_t ch = 0; ch < 16; ch++) {
+		for (uint8_t msg = 0; msg < MIDI_MSG_COUNT; msg++) {
+			uint8_t keyed = (msg == MIDI_MSG_NOTE_OFF) || (msg == MIDI_MSG_NOTE_ON) ||
+					(msg == MIDI_MSG_POLY_PRESSURE) || (msg == MIDI_MSG_CC);
+			// work out the outcome for every data byte value (only value 0 matters if not keyed)
+			for (uint8_t data = 0; data < 128; data++) {
+				row[data] = MIDI_FILTER_PASS; //no matching rule: pass unchanged
+				for (uint8_t r = 0; r < count; r++) {
+					const MIDI_Rule* rule = &rules[r];
+					if ((ch + 1 >= rule->channel_lo) && (ch + 1 <= rule->channel_hi) &&
+							(rule->msg_mask & MIDI_RULE_MSG(msg)) &&
+							(!keyed || ((data >= rule->data_lo) && (data <= rule->data_hi)))) {
+						row[data] = (rule->action == MIDI_RULE_DROP) ? MIDI_RULE_DROP : rule->action - 1;
+						break;
+					}
+				}
+				if (!keyed) {
+					break;
+				}
+			}
+			uint8_t data = 1;
+			while (keyed && (data < 128) && (row[data] == row[0])) {
+				data++;
+			}
+			if (!keyed || (data == 128)) {
+				table->status[ch][msg] = row[0]; //same outcome for every data byte
+				continue;
+			}
+			uint8_t index = 0;
+			while ((index < table->data_used) && (memcmp(table->data[index], row, 128) != 0)) {
+				index++;
+			}
+			if (index == table->data_used) {
+				if (table->data_used == MIDI_FILTER_DATA_TABLES) {
+					return HAL_ERROR;
+				}
+				memcpy(table->data[index], row, 128);
+				table->data_used++;
+			}
+			table->status[ch][msg] = 0x80 | index;
+		}
+	}
+	return HAL_OK;
+}
+
+/* MIDI_setFilter
+ * @brief 	Makes the parser use a compiled table, or no table at all (NULL).
+ * @param	table		The compiled table, or NULL to pass every message unchanged.
+ */
+void MIDI_setFilter(const MIDI_FilterTable* table) {
+	MIDI_filter = table;
+}
+#endif
+
+#if MIDI_HELD_NOTES
+/* MIDI_attachHeldNotes
+ * @brief 	Lets the parser keep a held-note set up to date with the notes of one channel.
+ * @param	channel		The MIDI channel, between 1 and 16.
+ * @param	notes		The set to feed (it is cleared first), or NULL to stop feeding it.
+ */
+void MIDI_attachHeldNotes(uint8_t channel, MIDI_HeldNotes* notes) {
+	if ((channel < 1) || (channel > 16)) {
+		return;
+	}
+	if (notes != NULL) {
+		MIDI_heldClear(notes);
+	}
+	MIDI_held_sets[channel - 1] = notes;
+}
 
-UART_HandleTypeDef* MIDI_uart; //uart pointer
+/* MIDI_heldClear
+ * @brief 	Empties a held-note set.
+ */
+void MIDI_heldClear(MIDI_HeldNotes* notes) {
+	memset(notes->keys, 0, sizeof(notes->keys));
+	notes->newest = MIDI_NOTE_NONE;
+	notes->oldest = MIDI_NOTE_NONE;
+	notes->count = 0;
+}
 
-uint8_t MIDI_buffer[MIDI_BUFF_SIZE]; //MIDI buffer
-uint8_t MIDI_buffer_index; //index of current byte (initialized to 0)
-uint8_t MIDI_message_length; //total number of bytes (including status) to expect
-uint8_t MIDI_max_valid; //index of last valid byte in array (stop point for MIDI_check)
-uint8_t MIDI_cmd_state; //FSM parameter for MIDI check (0: status byte, 1: data 1, 2: data 2, etc.)
-uint8_t MIDI_cmd_stage[MIDI_MAX_CMD_LEN]; //staging area for MIDI command as bytes come in (always re-centered around status byte)
-uint8_t MIDI_channel; //MIDI channel to listen to
+/* MIDI_heldInsert
+ * @brief 	Adds a note as the newest one; a note that is already held moves to the newest position.
+ */
+void MIDI_heldInsert(MIDI_HeldNotes* notes, uint8_t note) {
+	note &= 0x7F;
+	MIDI_heldRemove(notes, note);
+	notes->keys[note >> 5] |= 1UL << (note & 0x1F);
+	notes->older[note] = notes->newest;
+	notes->newer[note] = MIDI_NOTE_NONE;
+	if (notes->newest != MIDI_NOTE_NONE) {
+		notes->newer[notes->newest] = note;
+	}
+	else {
+		notes->oldest = note;
+	}
+	notes->newest = note;
+	notes->count++;
+}
 
-/* MIDI_DATA_RX
- * @brief 	A "MIDI data received" callback, called by the HAL. Check the Rx status and set flags.
- * @param 	huart		The handle of the UART that received data and called the callback.
- * @param	Size		The size/amount of data that is received/valid.
+/* MIDI_heldRemove
+ * @brief 	Removes a note, wherever it is in the play order. Does nothing if the note isn't held.
  */
-static void MIDI_DATA_RX(UART_HandleTypeDef* huart, uint16_t Size)
-{
-	if (huart->Instance == MIDI_uart->Instance) {
-		if (huart->RxEventType == HAL_UART_RXEVENT_HT) {
-			MIDI_rx_flag = 1; //first half ready
-			MIDI_rx_half = 1;
-			MIDI_max_valid = Size;
-		}
-		else if (huart->RxEventType == HAL_UART_RXEVENT_TC) {
-			MIDI_rx_flag = 1; //second half ready
-			MIDI_rx_half = 2;
-			MIDI_max_valid = Size;
-		}
-		else if (huart->RxEventType == HAL_UART_RXEVENT_IDLE) {
-			MIDI_rx_flag = 1; //received data ready (undetermined half)
-			MIDI_max_valid = Size;
-		}
+void MIDI_heldRemove(MIDI_HeldNotes* notes, uint8_t note) {
+	note &= 0x7F;
+	uint32_t bit = 1UL << (note & 0x1F);
+	if (!(notes->keys[note >> 5] & bit)) {
+		return;
+	}
+	notes->keys[note >> 5] &= ~bit;
+	uint8_t older = notes->older[note];
+	uint8_t newer = notes->newer[note];
+	if (older != MIDI_NOTE_NONE) {
+		notes->newer[older] = newer;
+	}
+	else {
+		notes->oldest = newer;
+	}
+	if (newer != MIDI_NOTE_NONE) {
+		notes->older[newer] = older;
+	}
+	else {
+		notes->newest = older;
 	}
+	notes->count--;
 }
 
-/* MIDI_parse
- * @brief 	Takes the completed MIDI command and interprets it, issuing the associated callback.
+/* MIDI_heldAbove
+ * @brief 	Pitch-order iteration: the lowest held note above the given one. Start with
+ * 			MIDI_heldLowest, or pass MIDI_NOTE_NONE to get the lowest note.
+ * @retval	The note number, or MIDI_NOTE_NONE if there is none.
  */
-static void MIDI_parse() {
-	// What type of message did we receive? (Check status byte value.)
-	// Call respective callback based on message received.
-	uint8_t status_msb = MIDI_cmd_stage[0] >> 4;
-	uint8_t status_lsb = MIDI_cmd_stage[0] & 0xF;
-	if ((MIDI_channel == MIDI_CHANNEL_ALL) || (status_lsb == MIDI_channel) ) {
-		if (status_msb == 0x8) {
-			// NOTE OFF
-			MIDI_noteOff(MIDI_cmd_stage[1] & 0x7F, MIDI_cmd_stage[2] & 0x7F);
-			MIDI_cmd_state = 0; //reset buffer index in case of running status
-		}
-		else if (status_msb == 0x9) {
-			// NOTE ON
-			if (MIDI_cmd_stage[2] == 0) {
-				// note_on velocity is 0 --> use Implicit Note Off
-				MIDI_noteOff(MIDI_cmd_stage[1] & 0x7F, 0);
-			}
-			else {
-				MIDI_noteOn(MIDI_cmd_stage[1] & 0x7F, MIDI_cmd_stage[2] & 0x7F);
-			}
-			MIDI_cmd_state = 0; //reset buffer index in case of running status
+uint8_t MIDI_heldAbove(const MIDI_HeldNotes* notes, uint8_t note) {
+	uint8_t word = 0;
+	uint32_t keys = notes->keys[0];
+	if (note != MIDI_NOTE_NONE) {
+		if (note >= 127) {
+			return MIDI_NOTE_NONE;
 		}
-		else if (status_msb == 0xB) {
-			// CONTROL CHANGE (CC)
-			MIDI_CC(MIDI_cmd_stage[1],MIDI_cmd_stage[2]);
-			MIDI_cmd_state = 0; //reset buffer index in case of running status
+		note++;
+		word = note >> 5;
+		keys = notes->keys[word] & (0xFFFFFFFFUL << (note & 0x1F));
+	}
+	while (keys == 0) {
+		if (++word == 4) {
+			return MIDI_NOTE_NONE;
 		}
-		else if (status_msb == 0xE) {
-			// PITCH-BEND
-			MIDI_pitchBend(((MIDI_cmd_stage[1] & 0x7F) | ((MIDI_cmd_stage[2] & 0x7F) << 7)) - 8192);
-			MIDI_cmd_state = 0; //reset buffer index in case of running status
+		keys = notes->keys[word];
+	}
+	return (word << 5) | __builtin_ctz(keys);
+}
+
+/* MIDI_heldBelow
+ * @brief 	Pitch-order iteration: the highest held note below the given one. Start with
+ * 			MIDI_heldHighest, or pass MIDI_NOTE_NONE to get the highest note.
+ * @retval	The note number, or MIDI_NOTE_NONE if there is none.
+ */
+uint8_t MIDI_heldBelow(const MIDI_HeldNotes* notes, uint8_t note) {
+	int8_t word = 3;
+	uint32_t keys = notes->keys[3];
+	if (note != MIDI_NOTE_NONE) {
+		if (note == 0) {
+			return MIDI_NOTE_NONE;
 		}
-		else {
-			//not a supported MIDI message. ignore! :)
+		note--;
+		word = note >> 5;
+		keys = notes->keys[word] & (0xFFFFFFFFUL >> (31 - (note & 0x1F)));
+	}
+	while (keys == 0) {
+		if (--word < 0) {
+			return MIDI_NOTE_NONE;
 		}
+		keys = notes->keys[word];
 	}
-	else {
-		//not the correct MIDI channel. ignore! :)
+	return (word << 5) | (31 - __builtin_clz(keys));
+}
+
+uint8_t MIDI_heldLowest(const MIDI_HeldNotes* notes) {
+	return MIDI_heldAbove(notes, MIDI_NOTE_NONE);
+}
+
+uint8_t MIDI_heldHighest(const MIDI_HeldNotes* notes) {
+	return MIDI_heldBelow(notes, MIDI_NOTE_NONE);
+}
+#endif
+
+#if MIDI_PRESETS
+/* MIDI_presetLoaded
+ * @brief 	Reports that the preset data requested by MIDI_presetLoad is now in its slot. Can be called
+ * 			from an interrupt (e.g. the DMA/QSPI transfer-complete callback); the preset change itself
+ * 			is committed by the next MIDI_check.
+ * @param	slot		The cache slot passed to MIDI_presetLoad.
+ */
+void MIDI_presetLoaded(uint8_t slot) {
+	if (slot < MIDI_PRESET_CACHE_SLOTS) {
+		MIDI_preset_ready[slot] = 1;
+	}
+}
+#endif
+
+#if MIDI_MTS
+/* MIDI_getTuning
+ * @brief 	Returns the live pitch table of a channel: one MIDI_Pitch per note number. Read the pointer
+ * 			once per audio block; tuning changes go live between blocks, never halfway through one.
+ * 			The returned table is marked as held and is not edited until the next call for the channel.
+ * @param	channel		The MIDI channel, between 1 and 16.
+ */
+const MIDI_Pitch* MIDI_getTuning(uint8_t channel) {
+	channel = (channel - 1) & 0x0F;
+	uint8_t front;
+	do {
+		front = MIDI_tuning_front[channel];
+		MIDI_tuning_held[channel] = front;
+	} while (front != MIDI_tuning_front[channel]); //a swap in between may have picked this table to edit
+	return MIDI_tuning[channel][front];
+}
+
+/* MIDI_resetTuning
+ * @brief 	Sets every channel back to equal temperament with A4 = 440Hz.
+ */
+void MIDI_resetTuning() {
+	for (uint8_t note = 0; note < 128; note++) {
+		MIDI_tuning[0][0][note] = MIDI_mtsPitch(note);
+	}
+	for (uint8_t ch = 0; ch < 16; ch++) {
+		memcpy(MIDI_tuning[ch][0], MIDI_tuning[0][0], sizeof(MIDI_tuning[ch][0]));
+		memcpy(MIDI_tuning[ch][1], MIDI_tuning[0][0], sizeof(MIDI_tuning[ch][1]));
+		memcpy(MIDI_tuning[ch][2], MIDI_tuning[0][0], sizeof(MIDI_tuning[ch][2]));
+		MIDI_tuning_front[ch] = 0;
+		MIDI_tuning_held[ch] = 0;
+	}
+	MIDI_tuning_ready = 1;
+}
+#endif
+
+#if MIDI_ZONES
+/* MIDI_setZone
+ * @brief 	Sets up one zone and the keys it covers on one input channel. Call it several times with
+ * 			the same zone to cover more channels or key ranges; overlapping zones form layers.
+ * @param	zone		The zone to set up, between 0 and MIDI_ZONE_COUNT-1.
+ * @param	config		Output channel, transpose and velocity scaling of the zone.
+ * @param	channel		The input channel, between 1 and 16.
+ * @param	note_lo		Lowest input note of the zone.
+ * @param	note_hi		Highest input note of the zone.
+ * @retval	HAL_OK, or HAL_ERROR if an argument is out of range.
+ */
+HAL_StatusTypeDef MIDI_setZone(uint8_t zone, const MIDI_Zone* config, uint8_t channel, uint8_t note_lo, uint8_t note_hi) {
+	if ((zone >= MIDI_ZONE_COUNT) || (config->channel < 1) || (config->channel > 16) ||
+			(channel < 1) || (channel > 16) || (note_lo > note_hi) || (note_hi > 127)) {
+		return HAL_ERROR;
 	}
+	MIDI_zones[zone] = *config;
+	for (uint8_t note = note_lo; note <= note_hi; note++) {
+		MIDI_zone_map[channel - 1][note] |= 1 << zone;
+	}
+	MIDI_zone_inputs[channel - 1] |= 1 << zone;
+	return HAL_OK;
+}
+
+/* MIDI_clearZones
+ * @brief 	Removes all zones; every note is delivered on its own channel again.
+ */
+void MIDI_clearZones() {
+	memset(MIDI_zone_map, 0, sizeof(MIDI_zone_map));
+	memset(MIDI_zone_inputs, 0, sizeof(MIDI_zone_inputs));
+}
+#endif
+
+#if MIDI_PROFILING
+/* MIDI_getProfile
+ * @brief 	Copies the handler and parser time accounting gathered since MIDI_init or the last
+ * 			MIDI_resetProfile. Times are in CPU cycles (SystemCoreClock per second).
+ * @param	profile		Where to store the copy.
+ */
+void MIDI_getProfile(MIDI_Profile* profile) {
+	memcpy(profile, &MIDI_profile, sizeof(MIDI_Profile));
+}
+
+/* MIDI_resetProfile
+ * @brief 	Starts the time accounting over.
+ */
+void MIDI_resetProfile() {
+	memset(&MIDI_profile, 0, sizeof(MIDI_Profile));
+}
+#endif
+
+/* MIDI_rxStart
+ * @brief 	Starts the UART/DMA reception into MIDI_buffer, from the start of the buffer. The parser
+ * 			state is left alone.
+ * @param 	huart		The handle of the UART to listen to.
+ */
+static void MIDI_rxStart(UART_HandleTypeDef* huart) {
+	MIDI_buffer_index = 0;
+	MIDI_max_valid = 0;
+	MIDI_rx_flag = 0;
+	MIDI_rx_stopped = 0;
+#if MIDI_ISR_NOTE_ON
+	MIDI_isr_index = 0;
+	MIDI_isr_status = 0;
+#endif
+#if MIDI_RX_MODERATION || MIDI_RX_STATS
+	MIDI_rx_position = 0;
+#endif
+#if MIDI_RX_STATS
+	MIDI_rx_consumed = MIDI_rx_received; //whatever was lost before a restart isn't waiting anymore
+#endif
+#if MIDI_RX_MODERATION
+	MIDI_mod_polling = 0; //reception starts with IDLE interrupts on
+#endif
+#if MIDI_DMA_DOUBLE_BUFFER
+	MIDI_dmaStart(huart); //start uart comms
+#else
+	HAL_UARTEx_ReceiveToIdle_DMA(huart, MIDI_buffer, MIDI_BUFF_SIZE); //start uart comms
+#endif
+#if MIDI_RX_TIMEOUT
+	MIDI_rtoStart(huart);
+#endif
 }
 
 /* MIDI_init
@@ -178,17 +1958,360 @@ static void MIDI_parse() {
  * 						listen to ALL 16 channels.
  */
 void MIDI_init(UART_HandleTypeDef* huart, uint8_t channel) {
-	MIDI_buffer_index = 0;
-	MIDI_message_length = MIDI_BUFF_SIZE; //init the message length to the max allowable
+	MIDI_message_length = 0xFF; //no message expected before the first status byte
 	MIDI_uart = huart; //save the uart to listen to
+	MIDI_active_sensing = 0;
+#if MIDI_PROFILING
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk; //start the cycle counter, if the debugger hasn't already
+#if defined(__CORE_CM7_H_GENERIC)
+	DWT->LAR = 0xC5ACCE55; //unlock the DWT on Cortex-M7
+#endif
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	MIDI_profile_budget = (SystemCoreClock / 1000000) * MIDI_HANDLER_BUDGET_US;
+	MIDI_resetProfile();
+#endif
+#if MIDI_RX_STATS
+	MIDI_resetRxStats();
+#endif
+#if MIDI_MUX
+	memset(MIDI_cables, 0, sizeof(MIDI_cables));
+	for (uint8_t cable = 0; cable < 16; cable++) {
+		MIDI_cables[cable].message_length = 0xFF;
+	}
+	MIDI_cable = 0;
+	MIDI_mux_state = 0;
+	MIDI_mux_errors = 0;
+#if MIDI_NOTE_TRACKING
+	memset(MIDI_cable_notes_held, 0, sizeof(MIDI_cable_notes_held));
+	memset(MIDI_cable_notes_held_count, 0, sizeof(MIDI_cable_notes_held_count));
+#endif
+#endif
+#if MIDI_RX_MODERATION
+	MIDI_mod_counted = MIDI_rx_received;
+	MIDI_mod_window_tick = HAL_GetTick();
+#endif
+	for (uint8_t ch = 0; ch < 16; ch++) {
+		MIDI_trackChannelOff(ch); //nothing is held yet (on the other cables, cleared above)
+#if MIDI_PEDALS
+		MIDI_pedalClear(ch, 1);
+#endif
+	}
+#if MIDI_STUCK_NOTES
+	MIDI_resetNoteDurations();
+	MIDI_stuck_scan_tick = HAL_GetTick();
+#endif
+#if MIDI_PRESETS
+	for (uint8_t slot = 0; slot < MIDI_PRESET_CACHE_SLOTS; slot++) {
+		MIDI_preset_ids[slot] = MIDI_PRESET_NONE;
+		MIDI_preset_lru[slot] = slot;
+		MIDI_preset_ready[slot] = 0;
+	}
+	memset(MIDI_preset_active, MIDI_PRESET_NO_SLOT, sizeof(MIDI_preset_active));
+	memset(MIDI_preset_pending, MIDI_PRESET_NO_SLOT, sizeof(MIDI_preset_pending));
+	MIDI_preset_waiting = 0;
+#endif
+#if MIDI_MTS
+	if (!MIDI_tuning_ready) {
+		MIDI_resetTuning(); //tuning received before a re-init is kept
+	}
+#endif
 	if ((channel > 0) && (channel <= 16)) {
 		MIDI_channel = channel - 1; //channel should be between 1 and 16
 	}
 	else {
 		MIDI_channel = MIDI_CHANNEL_ALL; //resort to listening to all channels if invalid channel provided
 	}
+#if !MIDI_DIRECT_IRQ
 	HAL_UART_RegisterRxEventCallback(huart, MIDI_DATA_RX); // register the user-defined RX callback
-	HAL_UARTEx_ReceiveToIdle_DMA(huart, MIDI_buffer, MIDI_BUFF_SIZE); //start uart comms
+	HAL_UART_RegisterCallback(huart, HAL_UART_ERROR_CB_ID, MIDI_UART_ERROR);
+#endif
+	MIDI_rxStart(huart);
+}
+
+#if MIDI_RX_STATS
+/* MIDI_rxStats
+ * @brief 	Records the time since the last MIDI_check and how many received bytes are waiting: the
+ * 			bytes received up to the live DMA write position, minus those MIDI_check already took.
+ */
+static void MIDI_rxStats() {
+	uint32_t now = HAL_GetTick();
+	if ((MIDI_rx_stats.checks != 0) && ((now - MIDI_last_check_tick) > MIDI_rx_stats.max_check_gap)) {
+		MIDI_rx_stats.max_check_gap = now - MIDI_last_check_tick;
+	}
+	MIDI_last_check_tick = now;
+	MIDI_rx_stats.checks++;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq(); //the live DMA position and the last report must match
+#if MIDI_DMA_DOUBLE_BUFFER
+	uint16_t write = MIDI_DMA_BLOCK - __HAL_DMA_GET_COUNTER(MIDI_uart->hdmarx);
+	if (((DMA_Stream_TypeDef*)MIDI_uart->hdmarx->Instance)->CR & DMA_SxCR_CT) {
+		write += MIDI_DMA_BLOCK;
+	}
+#else
+	uint16_t write = MIDI_BUFF_SIZE - __HAL_DMA_GET_COUNTER(MIDI_uart->hdmarx);
+#endif
+	uint32_t received = MIDI_rx_received + (write + MIDI_BUFF_SIZE - MIDI_rx_position) % MIDI_BUFF_SIZE;
+	__set_PRIMASK(primask);
+	// counted, not taken from the buffer indices, so that an overflow shows up as MIDI_BUFF_SIZE or more
+	uint32_t backlog = received - MIDI_rx_consumed;
+	if (backlog > MIDI_rx_stats.max_backlog) {
+		MIDI_rx_stats.max_backlog = (backlog > 0xFFFF) ? 0xFFFF : backlog;
+	}
+}
+
+/* MIDI_getRxStats
+ * @brief 	Copies the buffer statistics gathered since MIDI_init or the last MIDI_resetRxStats.
+ * @param	stats		Where to store the copy.
+ */
+void MIDI_getRxStats(MIDI_RxStats* stats) {
+	memcpy(stats, &MIDI_rx_stats, sizeof(MIDI_RxStats));
+}
+
+/* MIDI_resetRxStats
+ * @brief 	Starts the buffer statistics over.
+ */
+void MIDI_resetRxStats() {
+	memset(&MIDI_rx_stats, 0, sizeof(MIDI_RxStats));
+}
+
+/* MIDI_recommendBufferSize
+ * @brief 	Suggests a MIDI_BUFF_SIZE from the statistics: the deepest backlog seen plus headroom,
+ * 			rounded up to a multiple of 8. With worst_case set, what the line can deliver at full speed
+ * 			during the longest MIDI_check gap is used instead when larger, so no burst can overrun it.
+ * @param	headroom	Extra space in percent of the backlog (e.g. 50).
+ * @param	worst_case	0: size for the traffic seen, 1: size for a full-speed burst.
+ */
+uint16_t MIDI_recommendBufferSize(uint8_t headroom, uint8_t worst_case) {
+	uint32_t needed = MIDI_rx_stats.max_backlog;
+	if (worst_case) {
+		uint32_t burst = (MIDI_rx_stats.max_check_gap * 1000 + MIDI_BYTE_US - 1) / MIDI_BYTE_US;
+		if (burst > needed) {
+			needed = burst;
+		}
+	}
+	needed = needed + (needed * headroom + 99) / 100 + 1; //the DMA position only equals the read position when empty
+	needed = (needed + 7) & ~7UL;
+	return (needed > 0xFFFF) ? 0xFFF8 : (uint16_t)needed;
+}
+#endif
+
+/* MIDI_releaseNotes
+ * @brief 	Does the work of MIDI_allNotesOff for the cable being parsed (with MIDI_MUX) or for the
+ * 			whole stream. A System Reset only releases the notes of the cable it came in on.
+ */
+static void MIDI_releaseNotes() {
+	for (uint8_t ch = 0; ch < 16; ch++) {
+#if MIDI_NOTE_TRACKING
+#if MIDI_PEDALS
+		MIDI_pedalClear(ch, 1); //a panic doesn't wait for the pedals, held notes or not
+#endif
+		if (MIDI_notes_held_count[ch] == 0) {
+			continue; //nothing to release on this channel
+		}
+		if (MIDI_notes_held_count[ch] >= MIDI_ALL_NOTES_OFF_MIN) {
+			MIDI_deliver(MIDI_MSG_CC, ch, 123, 0);
+		}
+		else {
+			for (uint8_t word = 0; word < 4; word++) {
+				uint32_t held = MIDI_notes_held[ch][word];
+				while (held) {
+					uint8_t bit = __builtin_ctz(held);
+					held &= held - 1;
+					MIDI_deliver(MIDI_MSG_NOTE_OFF, ch, (word << 5) | bit, 0);
+				}
+			}
+		}
+#else
+		// nothing is tracked, so fall back to CC 123 on every channel we listen to
+		if ((MIDI_channel == MIDI_CHANNEL_ALL) || (MIDI_channel == ch)) {
+			MIDI_deliver(MIDI_MSG_CC, ch, 123, 0);
+		}
+#endif
+	}
+}
+
+/* MIDI_parseByte
+ * @brief 	Runs one received byte through the state machine: real-time bytes, SysEx and
+ * 			running status are handled here, complete messages are passed on to MIDI_parse.
+ * @param	new_byte	The received byte.
+ */
+static void MIDI_parseByte(uint8_t new_byte) {
+	if (new_byte == 0xFF) {
+		// SYSTEM RESET: Used as a panic button. Makes all silent.
+		MIDI_cmd_state = 0;
+		MIDI_message_length = 0xFF; // prevent accidental parsing of a running status command after this
+		MIDI_active_sensing = 0;
+		if (MIDI_sysex) {
+			MIDI_sysexEnd(0);
+			MIDI_sysex = 0;
+		}
+		MIDI_releaseNotes(); //of this cable only, with MIDI_MUX
+		MIDI_systemReset();
+	}
+	else if (new_byte == 0xFE) {
+		// ACTIVE SENSING: the sender promises to keep the line busy from now on.
+		// Real-time byte, so leave the running status untouched.
+		MIDI_active_sensing = 1;
+		return;
+	}
+	else if (new_byte >= 0xF8) {
+		// OTHER REAL-TIME BYTES (clock, start/stop...): may appear anywhere, even inside other
+		// messages, and must not disturb running status or SysEx. Not supported, so skip.
+		return;
+	}
+	else if (new_byte >= 0x80) {
+		//status byte
+		MIDI_cmd_state = 0;
+		if (MIDI_sysex) {
+			MIDI_sysexEnd(new_byte == 0xF7); //any status byte ends a SysEx message
+		}
+		MIDI_sysex = (new_byte == 0xF0);
+		if (MIDI_sysex) {
+			MIDI_sysexStart();
+		}
+		// CHECK WHAT TYPE OF MESSAGE, TO SET CORRECT MESSAGE LENGTH
+		uint8_t status_msb = new_byte >> 4;
+		if ((status_msb == 0x8) || (status_msb == 0x9) || (status_msb == 0xA) || (status_msb == 0xB) || (status_msb == 0xE)) {
+			MIDI_message_length = 2; // expect 2 data bytes
+		}
+		else if ((status_msb == 0xC) || (status_msb == 0xD)) {
+			MIDI_message_length = 1; // expect 1 data byte
+		}
+		else if ((new_byte == 0xF1) || (new_byte == 0xF3)) {
+			MIDI_message_length = 1; // expect 1 data byte
+		}
+		else if (new_byte == 0xF2) {
+			MIDI_message_length = 2; // expect 2 data bytes
+		}
+		else {
+			//not a supported MIDI message (probably SysEx)
+			MIDI_message_length = 0xFF; // ensure the message parsing *never* occurs
+		}
+	}
+	else if (MIDI_sysex) {
+		//SysEx data byte
+		MIDI_sysexData(new_byte);
+		return;
+	}
+	else {
+		//data byte
+		if (MIDI_cmd_state < MIDI_MAX_CMD_LEN) {
+			MIDI_cmd_state++; //move FSM to next position for data byte
+		}
+		else {
+			MIDI_cmd_state = 0;
+		}
+	}
+	if (MIDI_cmd_state < MIDI_MAX_CMD_LEN) {
+		MIDI_cmd_stage[MIDI_cmd_state] = new_byte;
+	}
+	if (MIDI_cmd_state >= MIDI_message_length) {
+		// Command Is Complete! (in theory)
+		// Parse This Command!
+		MIDI_parse();
+	}
+}
+
+#if MIDI_MUX
+/* MIDI_muxSelect
+ * @brief 	Switches the parser over to a cable: saves the running status and partial message of the
+ * 			current cable and loads those of the new one.
+ * @param	cable		The cable, between 0 and 15.
+ */
+static void MIDI_muxSelect(uint8_t cable) {
+	if (cable == MIDI_cable) {
+		return;
+	}
+	MIDI_CableState* state = &MIDI_cables[MIDI_cable];
+	state->cmd_state = MIDI_cmd_state;
+	state->message_length = MIDI_message_length;
+	memcpy(state->cmd_stage, MIDI_cmd_stage, sizeof(state->cmd_stage));
+	state->sysex = MIDI_sysex;
+	state = &MIDI_cables[cable];
+	MIDI_cmd_state = state->cmd_state;
+	MIDI_message_length = state->message_length;
+	memcpy(MIDI_cmd_stage, state->cmd_stage, sizeof(MIDI_cmd_stage));
+	MIDI_sysex = state->sysex;
+	MIDI_cable = cable;
+}
+
+/* MIDI_muxByte
+ * @brief 	Runs one received byte through the frame decoder. Frames are
+ * 			0xFD, cable (0-15), length (1-127), length MIDI bytes, checksum
+ * 			where the checksum is the low 7 bits of the sum of the cable, length and payload bytes.
+ * 			The payload of a valid frame is parsed as a continuation of that cable's stream.
+ * @param	new_byte	The received byte.
+ */
+static void MIDI_muxByte(uint8_t new_byte) {
+	if (new_byte == MIDI_MUX_SYNC) {
+		if (MIDI_mux_state != 0) {
+			MIDI_mux_errors++; //the previous frame was cut short
+		}
+		MIDI_mux_state = 1;
+		return;
+	}
+	switch (MIDI_mux_state) {
+	case 1:
+		MIDI_mux_cable = new_byte;
+		MIDI_mux_sum = new_byte;
+		MIDI_mux_state = (new_byte < 16) ? 2 : 0;
+		break;
+	case 2:
+		MIDI_mux_length = new_byte;
+		MIDI_mux_sum += new_byte;
+		MIDI_mux_count = 0;
+		MIDI_mux_state = ((new_byte > 0) && (new_byte < 0x80)) ? 3 : 0;
+		break;
+	case 3:
+		MIDI_mux_payload[MIDI_mux_count++] = new_byte;
+		MIDI_mux_sum += new_byte;
+		if (MIDI_mux_count == MIDI_mux_length) {
+			MIDI_mux_state = 4;
+		}
+		return;
+	case 4:
+		MIDI_mux_state = 0;
+		if (new_byte == (MIDI_mux_sum & 0x7F)) {
+			MIDI_muxSelect(MIDI_mux_cable);
+			for (uint8_t i = 0; i < MIDI_mux_length; i++) {
+				MIDI_parseByte(MIDI_mux_payload[i]);
+			}
+			return;
+		}
+		break;
+	default:
+		return; //between frames: wait for the next sync byte
+	}
+	if (MIDI_mux_state == 0) {
+		MIDI_mux_errors++;
+	}
+}
+
+/* MIDI_getCable
+ * @brief 	Returns the cable the message being handled came in on. Call it from the callbacks.
+ */
+uint8_t MIDI_getCable() {
+	return MIDI_cable;
+}
+
+/* MIDI_getFrameErrors
+ * @brief 	Returns the number of frames dropped since MIDI_init (bad checksum, bad header or cut short).
+ */
+uint32_t MIDI_getFrameErrors() {
+	return MIDI_mux_errors;
+}
+#endif
+
+/* MIDI_receive
+ * @brief 	Hands a received byte to the frame decoder (MIDI_MUX) or straight to the parser.
+ * @param	new_byte	The received byte.
+ */
+static inline void MIDI_receive(uint8_t new_byte) {
+#if MIDI_MUX
+	MIDI_muxByte(new_byte);
+#else
+	MIDI_parseByte(new_byte);
+#endif
 }
 
 /* MIDI_check
@@ -197,64 +2320,191 @@ void MIDI_init(UART_HandleTypeDef* huart, uint8_t channel) {
  * 			program loop somewhere to ensure MIDI data is continuously processed.
  */
 void MIDI_check() {
+#if MIDI_RX_STATS
+	MIDI_rxStats();
+#endif
+#if MIDI_RX_MODERATION
+	MIDI_moderate();
+#endif
+#if MIDI_PRESETS
+	if (MIDI_preset_waiting) {
+		// COMMIT PRESET CHANGES WHOSE DATA HAS FINISHED LOADING
+		for (uint8_t ch = 0; ch < 16; ch++) {
+			if ((MIDI_preset_waiting & (1 << ch)) && MIDI_preset_ready[MIDI_preset_pending[ch]]) {
+				MIDI_presetCommit(ch);
+			}
+		}
+	}
+#endif
+#if MIDI_STUCK_NOTES
+	MIDI_stuckScan();
+#endif
 	if (MIDI_rx_flag == 1) {
 		// NEW DATA AVAILABLE, RUN STATE MACHINE!
-		for (int i = MIDI_buffer_index; i < MIDI_max_valid; i++) {
-			uint8_t new_byte = MIDI_buffer[i];
-			if (new_byte == 0xFF) {
-				// SYSTEM RESET: Used as a panic button. Makes all silent.
-				MIDI_cmd_state = 0;
-				MIDI_message_length = 0xFF; // prevent accidental parsing of a running status command after this
-				MIDI_systemReset();
-			}
-			else if (new_byte >= 0x80) {
-				//status byte
-				MIDI_cmd_state = 0;
-				// CHECK WHAT TYPE OF MESSAGE, TO SET CORRECT MESSAGE LENGTH
-				uint8_t status_msb = new_byte >> 4;
-				if ((status_msb == 0x8) || (status_msb == 0x9) || (status_msb == 0xA) || (status_msb == 0xB) || (status_msb == 0xE)) {
-					MIDI_message_length = 2; // expect 2 data bytes
-				}
-				else if ((status_msb == 0xC) || (status_msb == 0xD)) {
-					MIDI_message_length = 1; // expect 1 data byte
-				}
-				else if ((new_byte == 0xF1) || (new_byte == 0xF3)) {
-					MIDI_message_length = 1; // expect 1 data byte
-				}
-				else if (new_byte == 0xF2) {
-					MIDI_message_length = 2; // expect 2 data bytes
-				}
-				else {
-					//not a supported MIDI message (probably SysEx)
-					MIDI_message_length = 0xFF; // ensure the message parsing *never* occurs
-				}
-			}
-			else {
-				//data byte
-				if (MIDI_cmd_state < MIDI_MAX_CMD_LEN) {
-					MIDI_cmd_state++; //move FSM to next position for data byte
-				}
-				else {
-					MIDI_cmd_state = 0;
-				}
+		MIDI_last_rx_tick = HAL_GetTick();
+#if MIDI_PROFILING
+		uint32_t start = DWT->CYCCNT;
+		MIDI_profile_in_handlers = 0;
+#endif
+#if MIDI_RX_STATS
+		uint32_t reported = MIDI_rx_received; //all of it is parsed below (and maybe a little more)
+#endif
+#if MIDI_DMA_DOUBLE_BUFFER
+		MIDI_rx_flag = 0; //reset first: the blocks are re-read below, so a report arriving meanwhile isn't lost
+		while (1) {
+			uint8_t full = MIDI_dma_full[MIDI_dma_block];
+			uint16_t end = full ? MIDI_DMA_BLOCK : MIDI_dma_fill[MIDI_dma_block];
+			uint8_t* block = &MIDI_buffer[MIDI_dma_block * MIDI_DMA_BLOCK];
+			while (MIDI_dma_read < end) {
+				MIDI_receive(block[MIDI_dma_read++]);
 			}
-			if (MIDI_cmd_state < MIDI_MAX_CMD_LEN) {
-				MIDI_cmd_stage[MIDI_cmd_state] = new_byte;
+			if (!full) {
+				break; //the DMA is still writing this block
 			}
-			if (MIDI_cmd_state >= MIDI_message_length) {
-				// Command Is Complete! (in theory)
-				// Parse This Command!
-				MIDI_parse();
+			MIDI_dma_fill[MIDI_dma_block] = 0; //block done, the DMA will refill it after the other one
+			MIDI_dma_full[MIDI_dma_block] = 0;
+			MIDI_dma_block ^= 1;
+			MIDI_dma_read = 0;
+		}
+#else
+		uint16_t max_valid = MIDI_max_valid;
+		if (max_valid < MIDI_buffer_index) {
+			// the DMA wrapped around since the last check (TC followed by IDLE): finish the end of the buffer first
+			for (int i = MIDI_buffer_index; i < MIDI_BUFF_SIZE; i++) {
+				MIDI_receive(MIDI_buffer[i]);
 			}
+			MIDI_buffer_index = 0;
 		}
-		MIDI_buffer_index = MIDI_max_valid; //reset buffer index to last byte read
-		if (MIDI_buffer_index >= MIDI_BUFF_SIZE - 1) {
+		for (int i = MIDI_buffer_index; i < max_valid; i++) {
+			MIDI_receive(MIDI_buffer[i]);
+		}
+		MIDI_buffer_index = max_valid; //reset buffer index to last byte read
+		if (MIDI_buffer_index >= MIDI_BUFF_SIZE) {
 			MIDI_buffer_index = 0;
 		}
 		MIDI_rx_flag = 0; //reset MIDI RX flag
+#endif
+#if MIDI_RX_STATS
+		MIDI_rx_consumed = reported;
+#endif
+#if MIDI_PROFILING
+		MIDI_profile.parser_cycles += (DWT->CYCCNT - start) - MIDI_profile_in_handlers;
+		MIDI_profile.checks++;
+#endif
+	}
+	else if (MIDI_active_sensing && ((HAL_GetTick() - MIDI_last_rx_tick) > MIDI_ACTIVE_SENSING_TIMEOUT)) {
+		// ACTIVE SENSING TIMEOUT: the sender went quiet, so treat the port as disconnected.
+		MIDI_active_sensing = 0;
+		MIDI_allNotesOff();
+	}
+	if (MIDI_rx_stopped) {
+		// A DMA ERROR STOPPED RECEPTION: START IT AGAIN. The bytes lost meanwhile are like any
+		// other gap in the stream; running status carries on.
+		HAL_UART_AbortReceive(MIDI_uart); //back to a known UART/DMA state
+		MIDI_rxStart(MIDI_uart);
 	}
 }
 
+/* MIDI_saveState
+ * @brief 	Take a snapshot of the parser: running status, partially received message, SysEx flag,
+ * 			channel filter, held notes and pedal state. The DMA position is not included, as the
+ * 			UART reception is restarted by MIDI_init anyway.
+ * @param	state		Where to store the snapshot.
+ */
+void MIDI_saveState(MIDI_State* state) {
+	state->size = sizeof(MIDI_State);
+	state->version = MIDI_STATE_VERSION;
+	state->features = MIDI_STATE_FEATURES;
+	state->channel = MIDI_channel;
+	state->cmd_state = MIDI_cmd_state;
+	state->message_length = MIDI_message_length;
+	memcpy(state->cmd_stage, MIDI_cmd_stage, sizeof(state->cmd_stage));
+	state->sysex = MIDI_sysex;
+	state->active_sensing = MIDI_active_sensing;
+#if MIDI_NOTE_TRACKING && MIDI_MUX
+	memcpy(state->notes_held, MIDI_cable_notes_held, sizeof(state->notes_held));
+	memcpy(state->notes_held_count, MIDI_cable_notes_held_count, sizeof(state->notes_held_count));
+#elif MIDI_NOTE_TRACKING
+	memcpy(state->notes_held, MIDI_notes_held, sizeof(state->notes_held));
+	memcpy(state->notes_held_count, MIDI_notes_held_count, sizeof(state->notes_held_count));
+#endif
+#if MIDI_PEDALS
+	state->pedal_sustain = MIDI_pedal_sustain;
+	state->pedal_sostenuto = MIDI_pedal_sostenuto;
+	memcpy(state->pedal_deferred, MIDI_pedal_deferred, sizeof(state->pedal_deferred));
+	memcpy(state->pedal_latched, MIDI_pedal_latched, sizeof(state->pedal_latched));
+#endif
+}
+
+/* MIDI_restoreState
+ * @brief 	Resume parsing from a snapshot taken with MIDI_saveState. Call this right after MIDI_init
+ * 			so the first bytes received after a DMA restart, wakeup or firmware swap are parsed with
+ * 			the old running status instead of being dropped until the next status byte.
+ * @param	state		The snapshot to restore.
+ * @retval	HAL_OK, or HAL_ERROR if the snapshot was saved by a build with a different MIDI_State
+ * 			layout, version or feature set (in which case the parser is left as MIDI_init set it up).
+ * 			The size alone can't tell two builds apart whose optional fields happen to add up the same.
+ */
+HAL_StatusTypeDef MIDI_restoreState(const MIDI_State* state) {
+	if ((state->size != sizeof(MIDI_State)) || (state->version != MIDI_STATE_VERSION) ||
+			(state->features != MIDI_STATE_FEATURES)) {
+		return HAL_ERROR;
+	}
+	MIDI_channel = state->channel;
+	MIDI_cmd_state = state->cmd_state;
+	MIDI_message_length = state->message_length;
+	memcpy(MIDI_cmd_stage, state->cmd_stage, sizeof(MIDI_cmd_stage));
+	MIDI_sysex = state->sysex;
+#if MIDI_MTS
+	MIDI_sysexStart();
+	MIDI_sysex_count = 0xFFFF; //a SysEx message cut by the restart is skipped, not decoded
+#endif
+	MIDI_active_sensing = state->active_sensing;
+	MIDI_last_rx_tick = HAL_GetTick(); //give an Active Sensing sender a full timeout to show up again
+#if MIDI_NOTE_TRACKING && MIDI_MUX
+	memcpy(MIDI_cable_notes_held, state->notes_held, sizeof(MIDI_cable_notes_held));
+	memcpy(MIDI_cable_notes_held_count, state->notes_held_count, sizeof(MIDI_cable_notes_held_count));
+#elif MIDI_NOTE_TRACKING
+	memcpy(MIDI_notes_held, state->notes_held, sizeof(MIDI_notes_held));
+	memcpy(MIDI_notes_held_count, state->notes_held_count, sizeof(MIDI_notes_held_count));
+#endif
+#if MIDI_STUCK_NOTES
+	// the note-on times weren't saved: the restored notes count as struck now
+	uint16_t now = (uint16_t)HAL_GetTick();
+	for (uint16_t i = 0; i < 16 * 128; i++) {
+		MIDI_note_on_tick[i >> 7][i & 0x7F] = now;
+	}
+	memset(MIDI_notes_stuck, 0, sizeof(MIDI_notes_stuck));
+#endif
+#if MIDI_PEDALS
+	MIDI_pedal_sustain = state->pedal_sustain;
+	MIDI_pedal_sostenuto = state->pedal_sostenuto;
+	memcpy(MIDI_pedal_deferred, state->pedal_deferred, sizeof(MIDI_pedal_deferred));
+	memcpy(MIDI_pedal_latched, state->pedal_latched, sizeof(MIDI_pedal_latched));
+#endif
+	return HAL_OK;
+}
+
+/* MIDI_allNotesOff
+ * @brief 	Release every note the library has recorded as held. Per channel, the library either calls
+ * 			MIDI_noteOff for each held note or calls MIDI_CC(123, 0) ("All Notes Off") once, whichever
+ * 			is cheaper on the wire: n note-offs cost 1+2n bytes with running status, CC 123 costs 3.
+ * 			Called automatically before MIDI_systemReset and when an Active Sensing sender goes quiet;
+ * 			call it yourself if you detect a disconnected port some other way. With MIDI_MUX, every
+ * 			cable's notes are released.
+ */
+void MIDI_allNotesOff() {
+#if MIDI_MUX
+	uint8_t cable = MIDI_cable;
+	for (MIDI_cable = 0; MIDI_cable < 16; MIDI_cable++) {
+		MIDI_releaseNotes(); //MIDI_getCable tells the callbacks which cable's notes they are
+	}
+	MIDI_cable = cable; //the parser state stays that of the cable being parsed
+#else
+	MIDI_releaseNotes();
+#endif
+}
+
 // THE FOLLOWING ARE THE FIVE USER-DEFINABLE CALLBACKS MENTIONED IN THE DOCUMENTATION
 // IMPLEMENT THESE ELSEWHERE IN YOUR CODE
 
@@ -267,3 +2517,32 @@ __weak void MIDI_CC(uint8_t control_num, uint8_t value) { return; }
 __weak void MIDI_pitchBend(uint16_t pitchbend) { return; }
 
 __weak void MIDI_systemReset() { return; }
+
+#if MIDI_ISR_NOTE_ON
+// FAST-PATH NOTE-ON HOOK (MIDI_ISR_NOTE_ON ONLY). Called from the UART/DMA interrupt!
+
+__weak void MIDI_noteOnFast(uint8_t channel, uint8_t note_num, uint8_t velocity) { return; }
+#endif
+
+#if MIDI_PRESETS
+// PRESET CALLBACKS (MIDI_PRESETS ONLY). The default loader reports the slot as filled straight away,
+// so without your own MIDI_presetLoad every program change is committed immediately.
+
+__weak void MIDI_presetLoad(uint8_t slot, uint16_t bank, uint8_t program) { MIDI_presetLoaded(slot); }
+
+__weak void MIDI_presetChange(uint8_t channel, uint16_t bank, uint8_t program, uint8_t slot) { return; }
+#endif
+
+#if MIDI_PROFILING
+// HANDLER OVERRUN CALLBACK (MIDI_PROFILING ONLY). Called right after the handler that went over the
+// MIDI_HANDLER_BUDGET_US budget, with the message class, channel (0-15) and the cycles it took.
+
+__weak void MIDI_handlerOverrun(MIDI_MsgClass msg, uint8_t channel, uint32_t cycles) { return; }
+#endif
+
+#if MIDI_STUCK_NOTES
+// STUCK NOTE CALLBACK (MIDI_STUCK_NOTES ONLY). Return 1 to have the library send the note-off (channel
+// 0-15) on its own, 0 to only take note of it.
+
+__weak uint8_t MIDI_stuckNote(uint8_t channel, uint8_t note_num, MIDI_StuckReason reason, uint32_t held_ms) { return 0; }
+#endif
@@ -68,6 +68,164 @@
  * 		important to have just in case. I recommend disabling all sounds/parameters/automation/etc
  * 		whenever this function is called, as it is intended as a panic button.
  *
+ * 	The library keeps a record of which notes are held on each channel. Before MIDI_systemReset is
+ * 	called, and when a sender that uses Active Sensing (0xFE) goes quiet for more than 300ms (e.g.
+ * 	the cable was pulled), the library releases only those held notes: per channel it calls
+ * 	MIDI_noteOff for each held note, or MIDI_CC(123, 0) ("All Notes Off") once if that is shorter on
+ * 	the wire. You can trigger the same thing yourself with MIDI_allNotesOff(). #define
+ * 	MIDI_NOTE_TRACKING as 0 to drop the record (and its 272 bytes of RAM); MIDI_allNotesOff() then
+ * 	always uses CC 123.
+ *
+ * 	When a DMA error (or a line error the HAL aborts the reception on) stops the UART reception,
+ * 	the next MIDI_check starts it again by itself, keeping the parser state.
+ *
+ * 	If the UART has to be restarted (low-power mode, firmware swap), MIDI_init starts the
+ * 	parser from scratch and anything arriving under running status is dropped until the sender
+ * 	transmits a new status byte. To avoid that, save the parser with MIDI_saveState(&state) before
+ * 	stopping and call MIDI_restoreState(&state) right after MIDI_init. The MIDI_State struct only
+ * 	holds plain values, so it can live in backup SRAM or flash. It records its size, format version and
+ * 	the options that add state (MIDI_STATE_FEATURES), and a snapshot from a build where any of these
+ * 	differ is refused.
+ *
+ * 	For multitimbral designs where every channel drives its own part, #define MIDI_CHANNEL_HANDLERS
+ * 	as 1 and register handlers per channel and message class with MIDI_setHandler(channel, msg,
+ * 	handler, context), e.g. MIDI_setHandler(3, MIDI_MSG_NOTE_ON, part_noteOn, &parts[2]). A
+ * 	registered handler is called with its context pointer, the channel (0-15) and the two data bytes,
+ * 	and replaces the global callback for that channel and class; this also gives access to program
+ * 	change and aftertouch, which have no global callback. The table costs 8 bytes per entry (896
+ * 	bytes on a 32-bit MCU).
+ *
+ * 	To filter or re-route messages, #define MIDI_FILTER_RULES as 1, describe what you want as an
+ * 	array of MIDI_Rule (e.g. "channels 1-4, notes 36-60 -> channel 9" or "drop CC 0-31 on channel
+ * 	10"), compile it once with MIDI_compileRules(&table, rules, count) and activate it with
+ * 	MIDI_setFilter(&table). The rules are turned into lookup tables, so checking a message costs at
+ * 	most two table reads no matter how many rules there are. A new table can be compiled on the side
+ * 	and swapped in with MIDI_setFilter at any time.
+ *
+ * 	For keyboard splits and layers, #define MIDI_ZONES as 1 and set up to eight zones with
+ * 	MIDI_setZone(zone, &config, channel, note_lo, note_hi). Each zone plays on its own channel with its
+ * 	own transpose and velocity scaling; overlapping key ranges make layers. Zones are looked up
+ * 	through a 128-entry table per input channel (2KB of RAM), so a note costs one table read however
+ * 	many zones there are. Controllers, pitchbend and other non-note messages of an input channel go to
+ * 	every zone that channel feeds. Zoned notes reach the callbacks/handlers on the zone's channel.
+ *
+ * 	For microtonal work, #define MIDI_MTS as 1 and the library decodes MIDI Tuning Standard SysEx
+ * 	(bulk tuning dumps, single note tuning changes and scale/octave tuning) into a 128-entry pitch
+ * 	table per channel. MIDI_getTuning(channel) returns the live table, holding the frequency in Hz
+ * 	of every note, or the oscillator phase increment if MIDI_MTS_SAMPLE_RATE is #define-d, so nothing
+ * 	has to be computed at note-on. Each table is triple-buffered: a tuning message is written to a
+ * 	spare copy and goes live in one step when the message ends, so read the pointer once per audio
+ * 	block. MIDI_getTuning marks the table it returns as held, and tuning messages are never written
+ * 	into the live or the held table, so the table a block is reading does not change under it however
+ * 	many swaps happen meanwhile. Bulk dumps and single note changes apply to all channels. The tables
+ * 	take 24KB of RAM. Phase increments of notes at or above the sample rate are clamped to 0xFFFFFFFF.
+ *
+ * 	Mono synths (note priority) and arpeggiators can #define MIDI_HELD_NOTES as 1 and attach a
+ * 	MIDI_HeldNotes set to a channel with MIDI_attachHeldNotes(channel, &notes). The parser then keeps
+ * 	it up to date: notes->newest is the last note played, MIDI_heldLowest/MIDI_heldHighest give the
+ * 	lowest/highest held note, and the notes can be walked in play order (notes->older[]/newer[]) or
+ * 	pitch order (MIDI_heldAbove/MIDI_heldBelow). Adding and removing a note are O(1).
+ *
+ * 	#define MIDI_PEDALS as 1 to let the library handle the sustain (CC 64) and sostenuto (CC 66)
+ * 	pedals: while a pedal holds a note, its note-off is held back, and MIDI_noteOff is called for it
+ * 	when the pedal is lifted. Your code then only has to deal with plain note-ons and note-offs. The
+ * 	pedal CCs (and the soft pedal, CC 67, which doesn't affect note lengths) are still passed on to
+ * 	MIDI_CC. All Notes Off and All Sound Off (CC 123/120) drop the notes the pedals hold but leave the
+ * 	pedals down; MIDI_allNotesOff (System Reset, Active Sensing timeout) lifts them as well.
+ *
+ * 	Patch changes can be prefetched by #define-ing MIDI_PRESETS as 1. Bank select (CC 0/32) and
+ * 	program change are then combined into one preset request, and the library keeps a small LRU cache
+ * 	of recently used presets (MIDI_PRESET_CACHE_SLOTS slots; the preset data lives in your own
+ * 	buffers, one per slot). Two more callbacks are used:
+ * 	- MIDI_presetLoad(uint8_t slot, uint16_t bank, uint8_t program)
+ * 		called when a requested preset isn't cached. Start an asynchronous (DMA/QSPI) read of the preset
+ * 		into the buffer of that slot and call MIDI_presetLoaded(slot) when it completes (this may be
+ * 		done from the transfer-complete interrupt).
+ * 	- MIDI_presetChange(uint8_t channel, uint16_t bank, uint8_t program, uint8_t slot)
+ * 		called once the preset data is in its slot (immediately for cached presets). Switch the channel
+ * 		to it. If slot is MIDI_PRESET_NO_SLOT, every slot was in use (or still loading) and you have to
+ * 		load it yourself; the channel then plays from no slot.
+ *
+ * 	For latency-critical triggers (e.g. drums), #define MIDI_ISR_NOTE_ON as 1 and implement
+ * 	- MIDI_noteOnFast(uint8_t channel, uint8_t note_num, uint8_t velocity)
+ * 			called from the UART/DMA receive interrupt for every note-on (channel 0-15, after the
+ * 			MIDI_init channel filter but before filter rules, zones and pedals), as soon as its bytes
+ * 			arrive. This saves waiting for the next MIDI_check. The note-on still reaches MIDI_noteOn
+ * 			(or its handler) through MIDI_check as usual, so ignore it there if you already triggered it.
+ * 			As this runs in an interrupt it must be short: no HAL calls, no blocking, no MIDI_ functions.
+ * 			The library's part costs a few cycles per received byte. MIDI_noteOnFast is only ever called
+ * 			from the interrupt: while MIDI_RX_MODERATION polls the DMA from MIDI_check, the note-ons found
+ * 			by the poll only take the normal path.
+ *
+ * 	On STM32 parts with DMA streams (F2/F4/F7/H7), #define MIDI_DMA_DOUBLE_BUFFER as 1 to receive
+ * 	with the stream in double-buffer mode instead of a circular buffer. The two halves of the buffer
+ * 	are then separate DMA targets: a full half is handed over whole and only written again once the
+ * 	other half is full too, which MIDI_check can track exactly. Configure the UART RX DMA as for the
+ * 	default mode (circular, byte width, memory increment); MIDI_init sets up the rest.
+ *
+ * 	To skip the HAL's generic interrupt dispatch, #define MIDI_DIRECT_IRQ as 1. Then don't call
+ * 	HAL_UART_IRQHandler and HAL_DMA_IRQHandler for the MIDI UART and its RX DMA; call
+ * 	MIDI_UART_IRQHandler() from the USARTx_IRQHandler and MIDI_DMA_IRQHandler() from the DMA
+ * 	stream/channel IRQHandler (in stm32xxxx_it.c) instead. These read the DMA counter and clear the
+ * 	flags themselves, and USE_HAL_UART_REGISTER_CALLBACKS is no longer needed.
+ *
+ * 	On U(S)ARTs with a receiver timeout (F0/F3/F7/G4/H7/L4...) and MIDI_DIRECT_IRQ, #define
+ * 	MIDI_RX_TIMEOUT as 1 to end bursts with the programmable receiver timeout instead of the fixed
+ * 	one-byte IDLE event. The timeout adapts to the traffic: long bursts double it (up to
+ * 	MIDI_RX_TIMEOUT_MAX bit times, the latency ceiling), so dense streams raise fewer interrupts, and
+ * 	short ones halve it (down to MIDI_RX_TIMEOUT_MIN), so a lone message still gets through quickly.
+ *
+ * 	Heavy streams (long SysEx dumps, merged inputs) can raise thousands of IDLE interrupts a second.
+ * 	#define MIDI_RX_MODERATION as 1 to let MIDI_check watch the byte rate: above MIDI_MODERATION_HIGH
+ * 	bytes/s the IDLE interrupt is turned off and MIDI_check polls the DMA position instead, at most
+ * 	MIDI_MODERATION_LATENCY ms apart (provided the main loop runs that often). Below
+ * 	MIDI_MODERATION_LOW bytes/s the IDLE interrupt comes back for the lowest latency.
+ *
+ * 	To find out whether a slow MIDI response comes from the library or from your callbacks, #define
+ * 	MIDI_PROFILING as 1 (Cortex-M3 and up, uses the DWT cycle counter). Every handler call is timed
+ * 	per message class, separately from the parser's own time (MIDI_presetLoad and MIDI_presetChange
+ * 	count as program change handlers); read the totals with MIDI_getProfile.
+ * 	A call taking longer than MIDI_HANDLER_BUDGET_US microseconds is reported to
+ * 	- MIDI_handlerOverrun(MIDI_MsgClass msg, uint8_t channel, uint32_t cycles)
+ * 		called right after the handler returns (channel 0-15), e.g. to log it or blink an LED.
+ *
+ * 	To size the buffer from real data rather than guesswork, #define MIDI_RX_STATS as 1. MIDI_check
+ * 	then records the deepest backlog (received bytes waiting to be parsed) and the longest time
+ * 	between two MIDI_check calls; read them with MIDI_getRxStats after a representative session
+ * 	(e.g. a full SysEx dump). A backlog of MIDI_BUFF_SIZE or more means the DMA overwrote data
+ * 	before MIDI_check got to it. MIDI_recommendBufferSize turns them into a MIDI_BUFF_SIZE. Note that
+ * 	MIDI_check must run at least every MIDI_BUFF_SIZE x 0.32 ms: that's how long the line takes to
+ * 	fill the buffer at full speed.
+ *
+ * 	Stuck notes (a lost note-off) can be caught by #define-ing MIDI_STUCK_NOTES as 1. Every note-on
+ * 	is timestamped, note durations are kept in a histogram (MIDI_getNoteDurations), and
+ * 	- uint8_t MIDI_stuckNote(uint8_t channel, uint8_t note_num, MIDI_StuckReason reason, uint32_t held_ms)
+ * 		is called (channel 0-15) when a note is held longer than MIDI_STUCK_NOTE_TIMEOUT ms
+ * 		(MIDI_STUCK_TIMEOUT), or struck again without a note-off in between (MIDI_STUCK_RETRIGGER).
+ * 		Notes held by a pedal don't count. Return 1 to have the library send the missing note-off.
+ *
+ * 	For board-to-board links carrying several virtual MIDI cables over one fast UART (e.g. 2 Mbaud),
+ * 	#define MIDI_MUX as 1. The stream is then read as frames:
+ * 		0xFD, cable (0-15), length (1-127), length bytes of MIDI data, checksum
+ * 	where the checksum is the low 7 bits of the sum of the cable, length and data bytes. A frame can
+ * 	batch any number of messages, and each cable keeps its own running status between frames. Frames
+ * 	with a bad checksum are dropped (MIDI_getFrameErrors). The callbacks get the messages of every
+ * 	cable; call MIDI_getCable() in them to know which one. Held notes are tracked per cable (4.3KB of
+ * 	RAM): MIDI_allNotesOff releases every cable's notes, a System Reset those of its own cable. At such
+ * 	speeds, raise MIDI_BUFF_SIZE to hold a few ms of data. Some options can't be used with MIDI_MUX:
+ * 	MIDI_ISR_NOTE_ON, as the interrupt only sees the raw frames; MIDI_MTS, as a tuning dump split
+ * 	across frames would be cut by the other cables' frames; MIDI_STUCK_NOTES and MIDI_PEDALS, as their
+ * 	state is kept per channel, not per cable.
+ *
+ * 	To record what came in (e.g. to flash, for later analysis), MIDI_log.c/.h provide a compact
+ * 	binary log format and its decoder, with no HAL dependency so the same files build on the host.
+ * 	Events are stored with a millisecond delta time, running status, and flags that elide an
+ * 	exact repeat of the previous event or a control change value already logged for its controller;
+ * 	typical traffic takes 2-3 bytes per message. Logs are cut into fixed-size blocks (MIDI_logBegin,
+ * 	MIDI_logWrite, MIDI_logEnd), each decodable on its own (MIDI_logOpen, MIDI_logRead), so a lost or
+ * 	damaged block doesn't affect the others. Call MIDI_logWrite from the callbacks. On the host,
+ * 	MIDI_smfBegin, MIDI_smfWrite and MIDI_smfEnd turn the decoded events into a Standard MIDI File.
+ *
  * 	The MIDI data buffer is 128-bytes by default. You can override this by #define-ing
  * 	MIDI_BUFF_SIZE to whatever size you want (as long as it's divisible by two).
  *
@@ -96,8 +254,278 @@ extern "C" {
 #ifndef MIDI_CHANNEL_ALL
 #define MIDI_CHANNEL_ALL	0xFF	//0xFF means listen to all channels
 #endif
+
+#ifndef MIDI_MAX_CMD_LEN
+#define MIDI_MAX_CMD_LEN	8
+#endif
+
+#ifndef MIDI_NOTE_TRACKING
+#define MIDI_NOTE_TRACKING	1	//keep a record of held notes so they can be released on panic
+#endif
+
+#ifndef MIDI_CHANNEL_HANDLERS
+#define MIDI_CHANNEL_HANDLERS	0	//set to 1 to enable per-channel handlers (MIDI_setHandler)
+#endif
+
+#ifndef MIDI_FILTER_RULES
+#define MIDI_FILTER_RULES	0	//set to 1 to enable compiled filter/route rules (MIDI_compileRules)
+#endif
+
+#ifndef MIDI_FILTER_DATA_TABLES
+#define MIDI_FILTER_DATA_TABLES	4	//distinct note/controller range tables a MIDI_FilterTable can hold
+#endif
+
+#ifndef MIDI_ZONES
+#define MIDI_ZONES			0	//set to 1 to enable keyboard split/layer zones (MIDI_setZone)
+#endif
+
+#ifndef MIDI_ZONE_COUNT
+#define MIDI_ZONE_COUNT		8	//number of zones, at most 8
+#endif
+
+#ifndef MIDI_PEDALS
+#define MIDI_PEDALS			0	//set to 1 to hold back note-offs while the sustain/sostenuto pedal is down
+#endif
+
+#ifndef MIDI_PRESETS
+#define MIDI_PRESETS		0	//set to 1 to turn bank select + program change into cached, prefetched preset changes
+#endif
+
+#ifndef MIDI_PRESET_CACHE_SLOTS
+#define MIDI_PRESET_CACHE_SLOTS	4	//presets kept in RAM (your buffers), should exceed the channels using presets
+#endif
+
+#define MIDI_PRESET_NO_SLOT	0xFF	//MIDI_presetChange slot: not cached, load the preset yourself
+
+#ifndef MIDI_ISR_NOTE_ON
+#define MIDI_ISR_NOTE_ON	0	//set to 1 to get note-ons from the RX interrupt as well (MIDI_noteOnFast)
+#endif
+
+#ifndef MIDI_HELD_NOTES
+#define MIDI_HELD_NOTES		0	//set to 1 to let the parser feed held-note sets (MIDI_attachHeldNotes)
+#endif
+
+#ifndef MIDI_DMA_DOUBLE_BUFFER
+#define MIDI_DMA_DOUBLE_BUFFER	0	//set to 1 to receive into two DMA blocks that are handed over whole (STM32 DMA streams only)
+#endif
+
+#ifndef MIDI_DIRECT_IRQ
+#define MIDI_DIRECT_IRQ		0	//set to 1 to call MIDI_UART_IRQHandler/MIDI_DMA_IRQHandler instead of the HAL IRQ handlers
+#endif
+
+#ifndef MIDI_RX_TIMEOUT
+#define MIDI_RX_TIMEOUT		0	//set to 1 to end bursts with the adaptive receiver timeout instead of IDLE (needs MIDI_DIRECT_IRQ)
+#endif
+
+#ifndef MIDI_RX_MODERATION
+#define MIDI_RX_MODERATION	0	//set to 1 to swap IDLE interrupts for polling from MIDI_check while the byte rate is high
+#endif
+
+#ifndef MIDI_PROFILING
+#define MIDI_PROFILING		0	//set to 1 to measure the cycles spent in the handlers and in the parser (Cortex-M3 and up)
+#endif
+
+#ifndef MIDI_HANDLER_BUDGET_US
+#define MIDI_HANDLER_BUDGET_US	100	//MIDI_PROFILING: handler calls longer than this (us) raise MIDI_handlerOverrun, 0 = never
+#endif
+
+#ifndef MIDI_RX_STATS
+#define MIDI_RX_STATS		0	//set to 1 to record the deepest DMA buffer backlog and the longest gap between MIDI_check calls
+#endif
+
+#ifndef MIDI_STUCK_NOTES
+#define MIDI_STUCK_NOTES	0	//set to 1 to detect stuck notes and keep note duration statistics (MIDI_stuckNote)
+#endif
+
+#ifndef MIDI_STUCK_NOTE_TIMEOUT
+#define MIDI_STUCK_NOTE_TIMEOUT	10000	//MIDI_STUCK_NOTES: ms a note can be held before it counts as stuck (at most 30000)
+#endif
+
+#define MIDI_DURATION_BUCKETS	16	//note duration histogram: bucket n counts notes held 2^n to 2^(n+1) ms
+
+#ifndef MIDI_MUX
+#define MIDI_MUX			0	//set to 1 to receive up to 16 virtual cables as frames over one (fast) UART
+#endif
+
+#ifndef MIDI_MTS
+#define MIDI_MTS			0	//set to 1 to decode MIDI Tuning Standard SysEx into per-channel pitch tables
+#endif
 /* USER CODE END Private defines */
 
+/* USER CODE BEGIN Private types */
+
+/* MIDI_MsgClass
+ * Channel message classes, in status byte order: the class is the status byte's upper nibble - 8.
+ */
+typedef enum {
+	MIDI_MSG_NOTE_OFF = 0,
+	MIDI_MSG_NOTE_ON,
+	MIDI_MSG_POLY_PRESSURE,
+	MIDI_MSG_CC,
+	MIDI_MSG_PROGRAM_CHANGE,
+	MIDI_MSG_CHANNEL_PRESSURE,
+	MIDI_MSG_PITCH_BEND,
+	MIDI_MSG_COUNT
+} MIDI_MsgClass;
+
+/* MIDI_Handler
+ * A per-channel message handler. channel is 0-15; data1/data2 are the raw 7-bit data bytes (LSB/MSB
+ * for pitchbend, data2 is 0 for program change and channel pressure).
+ */
+typedef void (*MIDI_Handler)(void* context, uint8_t channel, uint8_t data1, uint8_t data2);
+
+#if MIDI_FILTER_RULES
+#define MIDI_RULE_DROP		0xFF	//MIDI_Rule action: discard the message
+#define MIDI_RULE_MSG(msg)	(1 << (msg))	//MIDI_Rule msg_mask bit for one message class
+#define MIDI_RULE_NOTES		(MIDI_RULE_MSG(MIDI_MSG_NOTE_OFF) | MIDI_RULE_MSG(MIDI_MSG_NOTE_ON) | MIDI_RULE_MSG(MIDI_MSG_POLY_PRESSURE))
+#define MIDI_RULE_ALL		0x7F
+
+/* MIDI_Rule
+ * One filter/route rule, e.g. {1, 4, MIDI_RULE_NOTES, 36, 60, 9} sends notes 36-60 of channels 1-4
+ * to channel 9, and {10, 10, MIDI_RULE_MSG(MIDI_MSG_CC), 0, 31, MIDI_RULE_DROP} drops CC 0-31 on
+ * channel 10. The data range only applies to notes, poly pressure and CC. The first matching rule wins.
+ * Rules see the status byte as sent: a note-on with velocity 0 follows the MIDI_MSG_NOTE_ON rules, like
+ * the note-on it ends, while a note-off sent as 0x8n follows the MIDI_MSG_NOTE_OFF ones.
+ */
+typedef struct {
+	uint8_t channel_lo; //first channel the rule applies to, 1-16
+	uint8_t channel_hi; //last channel the rule applies to, 1-16
+	uint8_t msg_mask; //message classes the rule applies to (MIDI_RULE_MSG/MIDI_RULE_NOTES/MIDI_RULE_ALL)
+	uint8_t data_lo; //first note/controller number the rule applies to
+	uint8_t data_hi; //last note/controller number the rule applies to
+	uint8_t action; //channel to deliver the message on (1-16), or MIDI_RULE_DROP
+} MIDI_Rule;
+
+/* MIDI_FilterTable
+ * A set of rules compiled by MIDI_compileRules into lookup tables: one entry per channel and message
+ * class, and for classes whose outcome depends on the note/controller number, a 128-entry table.
+ */
+typedef struct {
+	uint8_t status[16][MIDI_MSG_COUNT]; //channel 0-15 to deliver on, 0x7F (pass), MIDI_RULE_DROP or 0x80 | data table index
+	uint8_t data[MIDI_FILTER_DATA_TABLES][128]; //channel 0-15 to deliver on, 0x7F (pass) or MIDI_RULE_DROP, per data byte
+	uint8_t data_used; //number of data tables in use
+} MIDI_FilterTable;
+#endif
+
+#define MIDI_STATE_VERSION	1	//bump whenever the meaning of a MIDI_State field changes
+#define MIDI_STATE_FEATURES	(((MIDI_NOTE_TRACKING != 0) << 0) | ((MIDI_PEDALS != 0) << 1) | ((MIDI_MUX != 0) << 2))
+
+/* MIDI_State
+ * Snapshot of the parser, filled by MIDI_saveState and applied by MIDI_restoreState. It only holds
+ * plain values, so it can be kept in backup SRAM or written to flash as-is.
+ */
+typedef struct {
+	uint16_t size; //sizeof(MIDI_State) of the build that saved it
+	uint8_t version; //MIDI_STATE_VERSION of the build that saved it
+	uint8_t features; //MIDI_STATE_FEATURES of the build that saved it (which optional fields are there)
+	uint8_t channel; //MIDI channel filter
+	uint8_t cmd_state; //position of the parser FSM
+	uint8_t message_length; //data bytes expected for the current (running) status
+	uint8_t cmd_stage[MIDI_MAX_CMD_LEN]; //partially received message, cmd_stage[0] is the running status
+	uint8_t sysex; //SysEx message in progress
+	uint8_t active_sensing; //sender uses Active Sensing
+#if MIDI_NOTE_TRACKING && MIDI_MUX
+	uint32_t notes_held[16][16][4]; //held-note bitmaps, per cable
+	uint8_t notes_held_count[16][16];
+#elif MIDI_NOTE_TRACKING
+	uint32_t notes_held[16][4]; //held-note bitmaps
+	uint8_t notes_held_count[16];
+#endif
+#if MIDI_PEDALS
+	uint16_t pedal_sustain; //channels with the sustain pedal down
+	uint16_t pedal_sostenuto; //channels with the sostenuto pedal down
+	uint32_t pedal_deferred[16][4]; //note-offs held back by a pedal
+	uint32_t pedal_latched[16][4]; //notes caught by the sostenuto pedal
+#endif
+} MIDI_State;
+
+#if MIDI_PROFILING
+/* MIDI_HandlerProfile
+ * Time spent in the user handlers of one message class (MIDI_noteOn, the handler table entries...).
+ */
+typedef struct {
+	uint32_t calls; //handler calls
+	uint32_t overruns; //calls longer than the budget
+	uint32_t max_cycles; //longest single call
+	uint64_t cycles; //total
+} MIDI_HandlerProfile;
+
+/* MIDI_Profile
+ * Where MIDI_check spends its time: in the handlers, per message class, or in the library itself.
+ */
+typedef struct {
+	MIDI_HandlerProfile handlers[MIDI_MSG_COUNT]; //indexed by MIDI_MsgClass
+	uint64_t parser_cycles; //MIDI_check time outside the handlers
+	uint32_t checks; //MIDI_check calls that had data to parse
+} MIDI_Profile;
+#endif
+
+#if MIDI_RX_STATS
+/* MIDI_RxStats
+ * How close the receive buffer has come to overflowing, to size MIDI_BUFF_SIZE from real data.
+ */
+typedef struct {
+	uint16_t max_backlog; //most received bytes waiting when MIDI_check ran (MIDI_BUFF_SIZE or more: the buffer overflowed)
+	uint32_t max_check_gap; //longest time between two MIDI_check calls, in ms
+	uint32_t checks; //MIDI_check calls
+} MIDI_RxStats;
+#endif
+
+#if MIDI_STUCK_NOTES
+/* MIDI_StuckReason
+ * Why MIDI_stuckNote was called.
+ */
+typedef enum {
+	MIDI_STUCK_TIMEOUT = 0, //held longer than MIDI_STUCK_NOTE_TIMEOUT
+	MIDI_STUCK_RETRIGGER //note-on for a note that never got its note-off
+} MIDI_StuckReason;
+#endif
+
+#if MIDI_ZONES
+/* MIDI_Zone
+ * A keyboard zone: the notes it covers are played on its channel, transposed and with scaled
+ * velocity. Non-note messages of an input channel are passed to every zone that channel feeds.
+ */
+typedef struct {
+	uint8_t channel; //channel (1-16) the zone plays on
+	int8_t transpose; //semitones added to the note number
+	uint8_t velocity_scale; //note-on velocity gain in 1/64 steps (64 = unchanged)
+} MIDI_Zone;
+#endif
+
+#if MIDI_HELD_NOTES
+#define MIDI_NOTE_NONE		0xFF	//"no note" value of the held-note functions
+
+/* MIDI_HeldNotes
+ * The held notes of a channel, both in play order (a doubly linked list threaded through arrays
+ * indexed by note number) and in pitch order (a bitmap). Inserting and removing a note are O(1),
+ * and so are the newest, oldest, lowest and highest notes (at most four words are scanned).
+ * Feed it with MIDI_attachHeldNotes, or call MIDI_heldInsert/MIDI_heldRemove yourself.
+ */
+typedef struct {
+	uint32_t keys[4]; //bitmap of held notes (note n is bit n%32 of word n/32)
+	uint8_t newer[128]; //next note in play order, per held note
+	uint8_t older[128]; //previous note in play order, per held note
+	uint8_t newest; //last note played (MIDI_NOTE_NONE if empty)
+	uint8_t oldest; //first of the held notes played
+	uint8_t count; //number of held notes
+} MIDI_HeldNotes;
+#endif
+
+#if MIDI_MTS
+/* MIDI_Pitch
+ * One entry of a channel's pitch table: the frequency in Hz, or, if MIDI_MTS_SAMPLE_RATE is defined,
+ * the oscillator phase increment per sample at that rate (2^32 = one cycle per sample).
+ */
+#ifdef MIDI_MTS_SAMPLE_RATE
+typedef uint32_t MIDI_Pitch;
+#else
+typedef float MIDI_Pitch;
+#endif
+#endif
+
+/* USER CODE END Private types */
+
 /* USER CODE BEGIN Prototypes */
 
 /* MIDI_init
@@ -116,6 +544,209 @@ void MIDI_init(UART_HandleTypeDef* huart, uint8_t channel);
  */
 void MIDI_check();
 
+/* MIDI_allNotesOff
+ * @brief 	Release every note the library has recorded as held, using MIDI_noteOff for each held note
+ * 			or a single MIDI_CC(123, 0) per channel, whichever is cheaper on the wire. This is called
+ * 			automatically before MIDI_systemReset and when an Active Sensing sender goes quiet. With
+ * 			MIDI_MUX, every cable's notes are released (a System Reset only releases its own cable's).
+ */
+void MIDI_allNotesOff();
+
+/* MIDI_saveState
+ * @brief 	Take a snapshot of the parser (running status, partial message, SysEx flag, channel filter,
+ * 			held notes and pedal state), e.g. before stopping the DMA or entering a low-power mode.
+ * @param	state		Where to store the snapshot.
+ */
+void MIDI_saveState(MIDI_State* state);
+
+/* MIDI_restoreState
+ * @brief 	Resume parsing from a snapshot taken with MIDI_saveState. Call this right after MIDI_init.
+ * @param	state		The snapshot to restore.
+ * @retval	HAL_OK, or HAL_ERROR if the snapshot came from a build with a different MIDI_State layout,
+ * 			version or set of state-carrying features (MIDI_NOTE_TRACKING, MIDI_PEDALS, MIDI_MUX).
+ */
+HAL_StatusTypeDef MIDI_restoreState(const MIDI_State* state);
+
+#if MIDI_CHANNEL_HANDLERS
+/* MIDI_setHandler
+ * @brief 	Registers a handler for one message class on one MIDI channel (or on all of them). Messages
+ * 			with a registered handler go straight to it instead of the global callbacks below.
+ * @param	channel		The MIDI channel, between 1 and 16, or MIDI_CHANNEL_ALL.
+ * @param	msg			The message class (MIDI_MSG_...).
+ * @param	handler		The function to call, or NULL to go back to the global callback.
+ * @param	context		Passed to the handler as-is, e.g. a pointer to the synth part.
+ */
+void MIDI_setHandler(uint8_t channel, MIDI_MsgClass msg, MIDI_Handler handler, void* context);
+#endif
+
+#if MIDI_FILTER_RULES
+/* MIDI_compileRules
+ * @brief 	Compiles a list of rules into a MIDI_FilterTable. Do this once (not per message); checking a
+ * 			message against the table then costs at most two table reads, whatever the rule count.
+ * @param	table		The table to fill. Not used by the parser until passed to MIDI_setFilter.
+ * @param	rules		The rules, in priority order (the first matching rule wins).
+ * @param	count		Number of rules.
+ * @retval	HAL_OK, or HAL_ERROR if a rule is invalid (out of range, or an empty channel or data
+ * 			range) or the rules need more than MIDI_FILTER_DATA_TABLES distinct note/controller tables.
+ */
+HAL_StatusTypeDef MIDI_compileRules(MIDI_FilterTable* table, const MIDI_Rule* rules, uint8_t count);
+
+/* MIDI_setFilter
+ * @brief 	Makes the parser use a compiled table, or no table at all (NULL). The switch is a single
+ * 			pointer write, so a new table can be compiled on the side and swapped in live.
+ * @param	table		The compiled table, or NULL to pass every message unchanged.
+ */
+void MIDI_setFilter(const MIDI_FilterTable* table);
+#endif
+
+#if MIDI_ZONES
+/* MIDI_setZone
+ * @brief 	Sets up one zone and the keys it covers on one input channel. Call it several times with
+ * 			the same zone to cover more channels or key ranges; overlapping zones form layers.
+ * 			Change zones while no notes are held (or call MIDI_allNotesOff first).
+ * @param	zone		The zone to set up, between 0 and MIDI_ZONE_COUNT-1.
+ * @param	config		Output channel, transpose and velocity scaling of the zone.
+ * @param	channel		The input channel, between 1 and 16.
+ * @param	note_lo		Lowest input note of the zone.
+ * @param	note_hi		Highest input note of the zone.
+ * @retval	HAL_OK, or HAL_ERROR if an argument is out of range.
+ */
+HAL_StatusTypeDef MIDI_setZone(uint8_t zone, const MIDI_Zone* config, uint8_t channel, uint8_t note_lo, uint8_t note_hi);
+
+/* MIDI_clearZones
+ * @brief 	Removes all zones; every note is delivered on its own channel again.
+ */
+void MIDI_clearZones();
+#endif
+
+#if MIDI_HELD_NOTES
+/* MIDI_attachHeldNotes
+ * @brief 	Lets the parser keep a held-note set up to date with the notes of one channel.
+ * @param	channel		The MIDI channel, between 1 and 16.
+ * @param	notes		The set to feed (it is cleared first), or NULL to stop feeding it.
+ */
+void MIDI_attachHeldNotes(uint8_t channel, MIDI_HeldNotes* notes);
+
+/* MIDI_heldClear / MIDI_heldInsert / MIDI_heldRemove
+ * @brief 	Empty a held-note set, add a note as the newest one, or remove a note. All O(1).
+ */
+void MIDI_heldClear(MIDI_HeldNotes* notes);
+void MIDI_heldInsert(MIDI_HeldNotes* notes, uint8_t note);
+void MIDI_heldRemove(MIDI_HeldNotes* notes, uint8_t note);
+
+/* MIDI_heldLowest / MIDI_heldHighest / MIDI_heldAbove / MIDI_heldBelow
+ * @brief 	Pitch-order access: the lowest/highest held note, and the next held note above/below a
+ * 			given one. Play-order access is notes->newest/oldest and notes->older[]/newer[].
+ * @retval	The note number, or MIDI_NOTE_NONE if there is none.
+ */
+uint8_t MIDI_heldLowest(const MIDI_HeldNotes* notes);
+uint8_t MIDI_heldHighest(const MIDI_HeldNotes* notes);
+uint8_t MIDI_heldAbove(const MIDI_HeldNotes* notes, uint8_t note);
+uint8_t MIDI_heldBelow(const MIDI_HeldNotes* notes, uint8_t note);
+#endif
+
+#if MIDI_PRESETS
+/* MIDI_presetLoaded
+ * @brief 	Reports that the preset data requested by MIDI_presetLoad is now in its slot. Can be called
+ * 			from an interrupt, e.g. the DMA/QSPI transfer-complete callback.
+ * @param	slot		The cache slot passed to MIDI_presetLoad.
+ */
+void MIDI_presetLoaded(uint8_t slot);
+#endif
+
+#if MIDI_MTS
+/* MIDI_getTuning
+ * @brief 	Returns the live pitch table of a channel: one MIDI_Pitch per note number, so a note-on
+ * 			handler can look up its pitch instead of computing it. Read the pointer once per audio
+ * 			block; tuning changes go live between blocks, never halfway through one. The returned table
+ * 			is marked as held and tuning messages are not written into it until the next call for the
+ * 			channel, however many swaps happen meanwhile.
+ * @param	channel		The MIDI channel, between 1 and 16.
+ */
+const MIDI_Pitch* MIDI_getTuning(uint8_t channel);
+
+/* MIDI_resetTuning
+ * @brief 	Sets every channel back to equal temperament with A4 = 440Hz.
+ */
+void MIDI_resetTuning();
+#endif
+
+#if MIDI_PROFILING
+/* MIDI_getProfile
+ * @brief 	Copies the handler and parser time accounting gathered since MIDI_init or the last
+ * 			MIDI_resetProfile. Times are in CPU cycles (SystemCoreClock per second).
+ * @param	profile		Where to store the copy.
+ */
+void MIDI_getProfile(MIDI_Profile* profile);
+
+/* MIDI_resetProfile
+ * @brief 	Starts the time accounting over.
+ */
+void MIDI_resetProfile();
+#endif
+
+#if MIDI_RX_STATS
+/* MIDI_getRxStats
+ * @brief 	Copies the buffer statistics gathered since MIDI_init or the last MIDI_resetRxStats.
+ * @param	stats		Where to store the copy.
+ */
+void MIDI_getRxStats(MIDI_RxStats* stats);
+
+/* MIDI_resetRxStats
+ * @brief 	Starts the buffer statistics over.
+ */
+void MIDI_resetRxStats();
+
+/* MIDI_recommendBufferSize
+ * @brief 	Suggests a MIDI_BUFF_SIZE from the statistics: the deepest backlog seen plus headroom,
+ * 			rounded up to a multiple of 8. With worst_case set, what the line can deliver at full speed
+ * 			during the longest MIDI_check gap is used instead when larger, so no burst can overrun it.
+ * @param	headroom	Extra space in percent of the backlog (e.g. 50).
+ * @param	worst_case	0: size for the traffic seen, 1: size for a full-speed burst.
+ */
+uint16_t MIDI_recommendBufferSize(uint8_t headroom, uint8_t worst_case);
+#endif
+
+#if MIDI_STUCK_NOTES
+/* MIDI_getNoteDurations
+ * @brief 	Copies the note duration histogram: histogram[n] is the number of notes held between 2^n
+ * 			and 2^(n+1) ms (bucket 0 also counts shorter ones). The last bucket also counts every note
+ * 			held past MIDI_STUCK_NOTE_TIMEOUT (stuck or held by a pedal), however long it was held.
+ * @param	histogram	Where to store the MIDI_DURATION_BUCKETS counts.
+ */
+void MIDI_getNoteDurations(uint32_t* histogram);
+
+/* MIDI_resetNoteDurations
+ * @brief 	Clears the note duration histogram.
+ */
+void MIDI_resetNoteDurations();
+#endif
+
+#if MIDI_MUX
+/* MIDI_getCable
+ * @brief 	Returns the cable (0-15) the message being handled came in on. Call it from the callbacks.
+ */
+uint8_t MIDI_getCable();
+
+/* MIDI_getFrameErrors
+ * @brief 	Returns the number of frames dropped since MIDI_init (bad checksum, bad header or cut short).
+ */
+uint32_t MIDI_getFrameErrors();
+#endif
+
+#if MIDI_DIRECT_IRQ
+/* MIDI_UART_IRQHandler
+ * @brief 	Call from the MIDI UART's interrupt handler (USARTx_IRQHandler) instead of HAL_UART_IRQHandler.
+ */
+void MIDI_UART_IRQHandler();
+
+/* MIDI_DMA_IRQHandler
+ * @brief 	Call from the interrupt handler of the MIDI UART's RX DMA stream/channel instead of
+ * 			HAL_DMA_IRQHandler.
+ */
+void MIDI_DMA_IRQHandler();
+#endif
+
 //USER-DEFINABLE CALLBACKS - IMPLEMENT THESE ELSEWHERE IN YOUR PROGRAM CODE
 void MIDI_noteOn(uint8_t, uint8_t);
 void MIDI_noteOff(uint8_t, uint8_t);
@@ -123,6 +754,27 @@ void MIDI_CC(uint8_t, uint8_t);
 void MIDI_pitchBend(uint16_t);
 void MIDI_systemReset();
 
+#if MIDI_ISR_NOTE_ON
+//FAST-PATH NOTE-ON HOOK (MIDI_ISR_NOTE_ON ONLY) - CALLED FROM THE RX INTERRUPT
+void MIDI_noteOnFast(uint8_t channel, uint8_t note_num, uint8_t velocity);
+#endif
+
+#if MIDI_PRESETS
+//PRESET CALLBACKS (MIDI_PRESETS ONLY)
+void MIDI_presetLoad(uint8_t slot, uint16_t bank, uint8_t program);
+void MIDI_presetChange(uint8_t channel, uint16_t bank, uint8_t program, uint8_t slot);
+#endif
+
+#if MIDI_PROFILING
+//HANDLER OVERRUN CALLBACK (MIDI_PROFILING ONLY)
+void MIDI_handlerOverrun(MIDI_MsgClass msg, uint8_t channel, uint32_t cycles);
+#endif
+
+#if MIDI_STUCK_NOTES
+//STUCK NOTE CALLBACK (MIDI_STUCK_NOTES ONLY) - RETURN 1 TO HAVE THE LIBRARY SEND THE NOTE-OFF
+uint8_t MIDI_stuckNote(uint8_t channel, uint8_t note_num, MIDI_StuckReason reason, uint32_t held_ms);
+#endif
+
 /* USER CODE END Prototypes */
 
 #ifdef __cplusplus
@@ -0,0 +1,439 @@
+/*
+ * MIDI_log.c
+ *
+ * 	A compact binary log format for recording MIDI traffic to flash, its decoder, and a Standard
+ * 	MIDI File writer for the decoded events. See MIDI_log.h for the format and how to use it.
+ */
+
+#include "MIDI_log.h"
+#include <string.h>
+
+#define MIDI_LOG_MAGIC		0x4D	//first byte of a block ('M')
+#define MIDI_LOG_PORT		0xF9	//port change escape (an undefined MIDI status byte)
+#define MIDI_LOG_MAX_DELTA	0x3FFFFFFFUL	//largest delta time (ms) that fits next to the flags
+#define MIDI_LOG_MAX_EVENT	10	//worst-case encoded event: 5 delta bytes, port escape, status, 2 data bytes
+#define MIDI_SMF_DIVISION	0xE728	//SMPTE time division: 25 frames/s of 40 ticks, so 1 tick = 1 ms
+#define MIDI_SMF_TRACK		14	//offset of the track chunk (the header chunk is 14 bytes)
+#define MIDI_SMF_MAX_EVENT	14	//worst-case track event: 4 delta bytes, port meta event and delta (5), escaped message (5)
+
+#if (MIDI_LOG_CC_CACHE & (MIDI_LOG_CC_CACHE - 1)) || (MIDI_LOG_CC_CACHE > 256)
+#error "MIDI_LOG_CC_CACHE must be a power of two, at most 256"
+#endif
+
+/* MIDI_logDataLength
+ * @brief 	Number of data bytes that follow a status byte.
+ * @param	status		The status byte.
+ * @return	0 to 2, or 0xFF for what isn't logged (SysEx, undefined status bytes, data bytes).
+ */
+static uint8_t MIDI_logDataLength(uint8_t status) {
+	if (status < 0x80) {
+		return 0xFF;
+	}
+	if (status < 0xF0) {
+		return ((status & 0xE0) == 0xC0) ? 1 : 2; //program change and channel pressure have one
+	}
+	switch (status) {
+	case 0xF1: //MTC quarter frame
+	case 0xF3: //song select
+		return 1;
+	case 0xF2: //song position
+		return 2;
+	case 0xF6: //tune request
+	case 0xF8: //real-time messages
+	case 0xFA:
+	case 0xFB:
+	case 0xFC:
+	case 0xFE:
+	case 0xFF:
+		return 0;
+	default:
+		return 0xFF;
+	}
+}
+
+/* MIDI_logCache
+ * @brief 	Finds the cache entry of a controller. The cache is direct-mapped and both sides of the
+ * 			codec update it the same way, so a value is only elided if the decoder has it too.
+ * @param	coder		The encoder or decoder state.
+ * @param	key			Port, channel and controller, from MIDI_logKey.
+ */
+static MIDI_LogCC* MIDI_logCache(MIDI_LogCoder* coder, uint16_t key) {
+	return &coder->cc[(key ^ (key >> 7)) & (MIDI_LOG_CC_CACHE - 1)];
+}
+
+static uint16_t MIDI_logKey(const MIDI_LogEvent* event) {
+	return ((uint16_t)(event->port & 0x1F) << 11) | ((uint16_t)(event->status & 0x0F) << 7) | event->data1;
+}
+
+/* MIDI_logReset
+ * @brief 	Forgets everything: each block is coded on its own.
+ * @param	coder		The encoder or decoder state.
+ * @param	time		Time base of the block.
+ */
+static void MIDI_logReset(MIDI_LogCoder* coder, uint32_t time) {
+	memset(&coder->last, 0, sizeof(coder->last)); //port 0 until an escape says otherwise
+	coder->time = time;
+	coder->has_last = 0;
+	coder->running = 0;
+	memset(coder->cc, 0xFF, sizeof(coder->cc)); //0xFF never matches a 7-bit value
+}
+
+/* MIDI_logUpdate
+ * @brief 	Takes an event into account, on both sides of the codec.
+ * @param	coder		The encoder or decoder state.
+ * @param	event		The event just coded.
+ */
+static void MIDI_logUpdate(MIDI_LogCoder* coder, const MIDI_LogEvent* event) {
+	if (event->port != coder->last.port) {
+		coder->running = 0; //running status doesn't carry over a port change
+	}
+	if (event->status < 0xF0) {
+		coder->running = event->status; //system messages leave it alone
+	}
+	if ((event->status & 0xF0) == 0xB0) {
+		MIDI_LogCC* entry = MIDI_logCache(coder, MIDI_logKey(event));
+		entry->key = MIDI_logKey(event);
+		entry->value = event->data2;
+	}
+	coder->time = event->time;
+	coder->last = *event;
+	coder->has_last = 1;
+}
+
+/* MIDI_logBegin
+ * @brief 	Starts recording into an empty block.
+ * @param	log			The writer.
+ * @param	block		The block buffer; it must stay valid until MIDI_logEnd.
+ * @param	size		Size of the block, more than MIDI_LOG_HEADER bytes.
+ * @param	time		Current time in ms: the time base of the block.
+ */
+void MIDI_logBegin(MIDI_LogWriter* log, uint8_t* block, uint16_t size, uint32_t time) {
+	log->block = block;
+	log->size = size;
+	log->used = MIDI_LOG_HEADER;
+	MIDI_logReset(&log->coder, time);
+	block[4] = time & 0xFF;
+	block[5] = (time >> 8) & 0xFF;
+	block[6] = (time >> 16) & 0xFF;
+	block[7] = time >> 24;
+}
+
+/* MIDI_logWrite
+ * @brief 	Appends an event to the block. Events must come in time order.
+ * @param	log			The writer.
+ * @param	event		The event to record.
+ * @return	1 if the event was recorded (or skipped, for SysEx and undefined status bytes),
+ * 			0 if the block is full: end it and start a new one.
+ */
+uint8_t MIDI_logWrite(MIDI_LogWriter* log, const MIDI_LogEvent* event) {
+	MIDI_LogCoder* coder = &log->coder;
+	uint8_t length = MIDI_logDataLength(event->status);
+	if (length == 0xFF) {
+		return 1;
+	}
+	MIDI_LogEvent coded = { event->time, event->port & 0x7F, event->status, 0, 0 };
+	if (length > 0) {
+		coded.data1 = event->data1 & 0x7F;
+	}
+	if (length > 1) {
+		coded.data2 = event->data2 & 0x7F;
+	}
+	uint32_t delta = ((int32_t)(coded.time - coder->time) < 0) ? 0 : coded.time - coder->time;
+	if (delta > MIDI_LOG_MAX_DELTA) {
+		delta = MIDI_LOG_MAX_DELTA; //a gap of more than 12 days in one block: the time is off from there on
+	}
+	coded.time = coder->time + delta;
+	uint8_t flags = 0;
+	if (coder->has_last && (coded.port == coder->last.port) && (coded.status == coder->last.status) &&
+			(coded.data1 == coder->last.data1) && (coded.data2 == coder->last.data2)) {
+		flags = MIDI_LOG_REPEAT;
+	}
+	else if ((coded.status & 0xF0) == 0xB0) {
+		MIDI_LogCC* entry = MIDI_logCache(coder, MIDI_logKey(&coded));
+		if ((entry->key == MIDI_logKey(&coded)) && (entry->value == coded.data2)) {
+			flags = MIDI_LOG_CACHED;
+		}
+	}
+	// DELTA TIME AND FLAGS, most significant 7 bits first
+	uint8_t bytes[MIDI_LOG_MAX_EVENT];
+	uint8_t n = 0;
+	uint32_t value = (delta << 2) | flags;
+	for (int8_t shift = 28; shift > 0; shift -= 7) {
+		if ((value >> shift) || n) {
+			bytes[n++] = 0x80 | ((value >> shift) & 0x7F);
+		}
+	}
+	bytes[n++] = value & 0x7F;
+	if (!(flags & MIDI_LOG_REPEAT)) {
+		uint8_t running = coder->running;
+		if (coded.port != coder->last.port) {
+			bytes[n++] = MIDI_LOG_PORT;
+			bytes[n++] = coded.port;
+			running = 0;
+		}
+		if (coded.status != running) {
+			bytes[n++] = coded.status;
+		}
+		if (length > 0) {
+			bytes[n++] = coded.data1;
+		}
+		if ((length > 1) && !(flags & MIDI_LOG_CACHED)) {
+			bytes[n++] = coded.data2;
+		}
+	}
+	if (log->used + n > log->size) {
+		return 0;
+	}
+	memcpy(&log->block[log->used], bytes, n);
+	log->used += n;
+	MIDI_logUpdate(coder, &coded);
+	return 1;
+}
+
+/* MIDI_logEnd
+ * @brief 	Completes the block header. The block is ready to be written to flash.
+ * @param	log			The writer.
+ * @return	The number of bytes used in the block.
+ */
+uint16_t MIDI_logEnd(MIDI_LogWriter* log) {
+	log->block[0] = MIDI_LOG_MAGIC;
+	log->block[1] = MIDI_LOG_VERSION;
+	log->block[2] = log->used & 0xFF;
+	log->block[3] = log->used >> 8;
+	return log->used;
+}
+
+/* MIDI_logOpen
+ * @brief 	Starts decoding a block.
+ * @param	log			The reader.
+ * @param	block		The block.
+ * @param	size		Size of the block.
+ * @return	1 if the block has a valid header, 0 if it's empty (erased) or not a log block.
+ */
+uint8_t MIDI_logOpen(MIDI_LogReader* log, const uint8_t* block, uint16_t size) {
+	log->block = block;
+	log->used = 0;
+	log->position = 0;
+	log->error = 0;
+	if ((size < MIDI_LOG_HEADER) || (block[0] != MIDI_LOG_MAGIC) || (block[1] != MIDI_LOG_VERSION)) {
+		return 0;
+	}
+	uint16_t used = block[2] | (block[3] << 8);
+	if ((used < MIDI_LOG_HEADER) || (used > size)) {
+		return 0;
+	}
+	log->used = used;
+	log->position = MIDI_LOG_HEADER;
+	MIDI_logReset(&log->coder, block[4] | (block[5] << 8) | ((uint32_t)block[6] << 16) | ((uint32_t)block[7] << 24));
+	return 1;
+}
+
+/* MIDI_logNext
+ * @brief 	Fetches the next byte of the block.
+ * @return	1 if there was one, 0 at the end of the block.
+ */
+static uint8_t MIDI_logNext(MIDI_LogReader* log, uint8_t* byte) {
+	if (log->position >= log->used) {
+		return 0;
+	}
+	*byte = log->block[log->position++];
+	return 1;
+}
+
+/* MIDI_logDamaged
+ * @brief 	Gives up on the rest of a block that doesn't decode.
+ * @return	0, for MIDI_logRead to return.
+ */
+static uint8_t MIDI_logDamaged(MIDI_LogReader* log) {
+	log->error = 1;
+	log->position = log->used;
+	return 0;
+}
+
+/* MIDI_logRead
+ * @brief 	Decodes the next event of the block.
+ * @param	log			The reader.
+ * @param	event		Where to store the event.
+ * @return	1 if an event was decoded, 0 at the end of the block (log->error is set if it was damaged).
+ */
+uint8_t MIDI_logRead(MIDI_LogReader* log, MIDI_LogEvent* event) {
+	MIDI_LogCoder* coder = &log->coder;
+	uint8_t byte;
+	if (!MIDI_logNext(log, &byte)) {
+		return 0;
+	}
+	// DELTA TIME AND FLAGS
+	uint32_t value = byte & 0x7F;
+	for (uint8_t i = 0; byte & 0x80; i++) {
+		if ((i == 4) || !MIDI_logNext(log, &byte)) {
+			return MIDI_logDamaged(log);
+		}
+		value = (value << 7) | (byte & 0x7F);
+	}
+	uint8_t flags = value & 0x03;
+	uint32_t time = coder->time + (value >> 2);
+	if (flags == MIDI_LOG_REPEAT) {
+		if (!coder->has_last) {
+			return MIDI_logDamaged(log);
+		}
+		*event = coder->last;
+	}
+	else if (flags == (MIDI_LOG_REPEAT | MIDI_LOG_CACHED)) {
+		return MIDI_logDamaged(log);
+	}
+	else {
+		memset(event, 0, sizeof(MIDI_LogEvent));
+		event->port = coder->last.port;
+		uint8_t running = coder->running;
+		if (!MIDI_logNext(log, &byte)) {
+			return MIDI_logDamaged(log);
+		}
+		if (byte == MIDI_LOG_PORT) {
+			if (!MIDI_logNext(log, &event->port) || (event->port >= 0x80) || !MIDI_logNext(log, &byte)) {
+				return MIDI_logDamaged(log);
+			}
+			running = 0;
+		}
+		if (byte >= 0x80) {
+			event->status = byte;
+		}
+		else {
+			event->status = running;
+			log->position--; //a data byte: running status
+		}
+		uint8_t length = MIDI_logDataLength(event->status);
+		if (length == 0xFF) {
+			return MIDI_logDamaged(log); //no running status, or not a loggable status
+		}
+		if ((flags == MIDI_LOG_CACHED) && ((event->status & 0xF0) != 0xB0)) {
+			return MIDI_logDamaged(log);
+		}
+		if (length > 0) {
+			if (!MIDI_logNext(log, &event->data1) || (event->data1 >= 0x80)) {
+				return MIDI_logDamaged(log);
+			}
+			if ((length > 1) && (flags == MIDI_LOG_CACHED)) {
+				MIDI_LogCC* entry = MIDI_logCache(coder, MIDI_logKey(event));
+				if (entry->key != MIDI_logKey(event)) {
+					return MIDI_logDamaged(log);
+				}
+				event->data2 = entry->value;
+			}
+			else if (length > 1) {
+				if (!MIDI_logNext(log, &event->data2) || (event->data2 >= 0x80)) {
+					return MIDI_logDamaged(log);
+				}
+			}
+		}
+	}
+	event->time = time;
+	MIDI_logUpdate(coder, event);
+	return 1;
+}
+
+/* MIDI_smfPut32
+ * @brief 	Stores a 32-bit big-endian number, as SMF chunk headers have them.
+ */
+static void MIDI_smfPut32(uint8_t* bytes, uint32_t value) {
+	bytes[0] = value >> 24;
+	bytes[1] = (value >> 16) & 0xFF;
+	bytes[2] = (value >> 8) & 0xFF;
+	bytes[3] = value & 0xFF;
+}
+
+/* MIDI_smfBegin
+ * @brief 	Starts a Standard MIDI File: header chunk and the start of its only track.
+ * @param	smf			The writer.
+ * @param	file		The file buffer; it must stay valid until MIDI_smfEnd.
+ * @param	size		Size of the buffer, at least MIDI_SMF_MIN_SIZE bytes.
+ * @param	time		Time in ms the file starts at (that of the first event, usually).
+ */
+void MIDI_smfBegin(MIDI_SMFWriter* smf, uint8_t* file, uint32_t size, uint32_t time) {
+	static const uint8_t header[MIDI_SMF_TRACK + 8] = {
+		'M', 'T', 'h', 'd', 0, 0, 0, 6, //header chunk, 6 bytes
+		0, 0, 0, 1, MIDI_SMF_DIVISION >> 8, MIDI_SMF_DIVISION & 0xFF, //format 0, one track
+		'M', 'T', 'r', 'k', 0, 0, 0, 0 //track chunk, its length is filled in by MIDI_smfEnd
+	};
+	memcpy(file, header, sizeof(header));
+	smf->file = file;
+	smf->size = size;
+	smf->used = sizeof(header);
+	smf->time = time;
+	smf->running = 0;
+	smf->port = 0;
+}
+
+/* MIDI_smfWrite
+ * @brief 	Appends an event to the track. Events must come in time order.
+ * @param	smf			The writer.
+ * @param	event		The event, as decoded by MIDI_logRead.
+ * @return	1 if the event was added (or skipped, for SysEx and undefined status bytes), 0 if the
+ * 			buffer is full.
+ */
+uint8_t MIDI_smfWrite(MIDI_SMFWriter* smf, const MIDI_LogEvent* event) {
+	uint8_t length = MIDI_logDataLength(event->status);
+	if (length == 0xFF) {
+		return 1;
+	}
+	uint32_t delta = ((int32_t)(event->time - smf->time) < 0) ? 0 : event->time - smf->time;
+	if (delta > 0x0FFFFFFF) {
+		delta = 0x0FFFFFFF; //the largest SMF delta time, 3 days
+	}
+	uint8_t bytes[MIDI_SMF_MAX_EVENT];
+	uint8_t n = 0;
+	uint8_t running = smf->running;
+	for (int8_t shift = 21; shift > 0; shift -= 7) {
+		if ((delta >> shift) || n) {
+			bytes[n++] = 0x80 | ((delta >> shift) & 0x7F);
+		}
+	}
+	bytes[n++] = delta & 0x7F;
+	if (event->port != smf->port) {
+		// MIDI PORT META EVENT, then the event itself at the same time
+		bytes[n++] = 0xFF;
+		bytes[n++] = 0x21;
+		bytes[n++] = 1;
+		bytes[n++] = event->port & 0x7F;
+		bytes[n++] = 0;
+		running = 0; //meta events cancel running status
+	}
+	if (event->status >= 0xF0) {
+		// SYSTEM MESSAGE: SMF has no plain form for these, so store it as an escape (F7, length, bytes)
+		bytes[n++] = 0xF7;
+		bytes[n++] = 1 + length;
+		bytes[n++] = event->status;
+		running = 0;
+	}
+	else if (event->status != running) {
+		bytes[n++] = event->status;
+		running = event->status;
+	}
+	if (length > 0) {
+		bytes[n++] = event->data1 & 0x7F;
+	}
+	if (length > 1) {
+		bytes[n++] = event->data2 & 0x7F;
+	}
+	if (smf->used + n + 4 > smf->size) {
+		return 0; //the end of track must still fit
+	}
+	memcpy(&smf->file[smf->used], bytes, n);
+	smf->used += n;
+	smf->time += delta;
+	smf->running = running;
+	smf->port = event->port & 0x7F;
+	return 1;
+}
+
+/* MIDI_smfEnd
+ * @brief 	Ends the track and completes its length. There is always room left for this.
+ * @param	smf			The writer.
+ * @return	The size of the file.
+ */
+uint32_t MIDI_smfEnd(MIDI_SMFWriter* smf) {
+	static const uint8_t end[4] = { 0, 0xFF, 0x2F, 0 }; //end of track meta event
+	memcpy(&smf->file[smf->used], end, sizeof(end));
+	smf->used += sizeof(end);
+	MIDI_smfPut32(&smf->file[MIDI_SMF_TRACK + 4], smf->used - MIDI_SMF_TRACK - 8);
+	return smf->used;
+}
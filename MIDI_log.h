@@ -0,0 +1,202 @@
+/*
+ * MIDI_log.h
+ *
+ * 	A compact binary log format for recording MIDI traffic to flash, and its decoder.
+ * 	Plain C without HAL dependencies, so the same files build on the host to read the logs back.
+ *
+ * 	A log is a sequence of fixed-size blocks (e.g. one flash page or sector each), and every block
+ * 	can be decoded on its own. Events are stored as
+ * 	- a delta time in ms since the previous event, as a variable-length number (7 bits per byte,
+ * 	  high bit set on all bytes but the last), shifted left by 2 to make room for two flags:
+ * 	  MIDI_LOG_REPEAT (the event is an exact copy of the previous one, nothing else follows) and
+ * 	  MIDI_LOG_CACHED (a control change whose value is the last one logged for that controller,
+ * 	  only the controller number follows),
+ * 	- 0xF9 and the port number (0-127), if the port differs from the previous event's,
+ * 	- the status byte, unless it's a channel message with the same status as the previous one
+ * 	  (running status, reset at every port change),
+ * 	- the data bytes.
+ * 	Blocks start with an 8-byte header: 'M', format version, number of bytes used (16-bit LE) and
+ * 	the time of the block start in ms (32-bit LE). Unused bytes after the events are left alone
+ * 	(0xFF in erased flash). SysEx and undefined status bytes are not logged.
+ *
+ * 	Recording:
+ * 		MIDI_LogWriter log;
+ * 		MIDI_logBegin(&log, block, sizeof(block), HAL_GetTick());
+ * 		...
+ * 		if (!MIDI_logWrite(&log, &event)) { //block full
+ * 			MIDI_logEnd(&log); //then write the block to flash
+ * 			MIDI_logBegin(&log, block, sizeof(block), event.time);
+ * 			MIDI_logWrite(&log, &event);
+ * 		}
+ *
+ * 	Reading back, block by block:
+ * 		MIDI_LogReader reader;
+ * 		if (MIDI_logOpen(&reader, block, sizeof(block))) {
+ * 			while (MIDI_logRead(&reader, &event)) { ... }
+ * 		}
+ *
+ * 	The decoded events can be turned into a Standard MIDI File (format 0, one track, 1 tick = 1 ms)
+ * 	for a sequencer or DAW, in a buffer the size of the expected file:
+ * 		MIDI_SMFWriter smf;
+ * 		MIDI_smfBegin(&smf, file, sizeof(file), first_event_time);
+ * 		... MIDI_smfWrite(&smf, &event) for every event of every block, in order ...
+ * 		fwrite(file, 1, MIDI_smfEnd(&smf), f);
+ * 	Port changes become MIDI port meta events, system messages are stored as escaped (F7) events.
+ */
+
+#ifndef INC_MIDI_LOG_H_
+#define INC_MIDI_LOG_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#ifndef MIDI_LOG_CC_CACHE
+#define MIDI_LOG_CC_CACHE	64	//controller values remembered for MIDI_LOG_CACHED (power of two, at most 256)
+#endif
+
+#define MIDI_LOG_HEADER		8	//size of the block header
+#define MIDI_LOG_VERSION	1	//format version stored in the block header
+#define MIDI_LOG_REPEAT		1	//delta time flag: exact copy of the previous event
+#define MIDI_LOG_CACHED		2	//delta time flag: control change with the cached value
+#define MIDI_SMF_MIN_SIZE	26	//headers and end of track of an empty Standard MIDI File
+
+/* MIDI_LogEvent
+ * A logged MIDI message: channel messages and the system messages without SysEx data.
+ */
+typedef struct {
+	uint32_t time; //ms (whatever clock the writer used, e.g. HAL_GetTick)
+	uint8_t port; //input port or cable, 0-127
+	uint8_t status; //status byte
+	uint8_t data1; //first data byte (0 if none)
+	uint8_t data2; //second data byte (0 if none)
+} MIDI_LogEvent;
+
+/* MIDI_LogCC
+ * A cache entry: the last value logged for a port/channel/controller.
+ */
+typedef struct {
+	uint16_t key; //port, channel and controller (0xFFFF: empty)
+	uint8_t value;
+} MIDI_LogCC;
+
+/* MIDI_LogCoder
+ * What an encoder or decoder has to remember between the events of a block.
+ */
+typedef struct {
+	uint32_t time; //time of the previous event
+	MIDI_LogEvent last; //the previous event
+	uint8_t has_last; //whether there is a previous event in this block
+	uint8_t running; //running status (0: none)
+	MIDI_LogCC cc[MIDI_LOG_CC_CACHE]; //last controller values
+} MIDI_LogCoder;
+
+/* MIDI_LogWriter
+ * A block being recorded.
+ */
+typedef struct {
+	uint8_t* block;
+	uint16_t size; //block size
+	uint16_t used; //bytes written so far, header included
+	MIDI_LogCoder coder;
+} MIDI_LogWriter;
+
+/* MIDI_LogReader
+ * A block being decoded.
+ */
+typedef struct {
+	const uint8_t* block;
+	uint16_t used; //bytes of events in the block, header included
+	uint16_t position; //next byte to decode
+	uint8_t error; //set if the block turned out to be damaged
+	MIDI_LogCoder coder;
+} MIDI_LogReader;
+
+/* MIDI_SMFWriter
+ * A Standard MIDI File being built from decoded events.
+ */
+typedef struct {
+	uint8_t* file;
+	uint32_t size; //buffer size
+	uint32_t used; //bytes written so far, headers included
+	uint32_t time; //time of the previous event
+	uint8_t running; //running status (0: none)
+	uint8_t port; //port of the previous event
+} MIDI_SMFWriter;
+
+/* MIDI_logBegin
+ * @brief 	Starts recording into an empty block.
+ * @param	log			The writer.
+ * @param	block		The block buffer; it must stay valid until MIDI_logEnd.
+ * @param	size		Size of the block, more than MIDI_LOG_HEADER bytes.
+ * @param	time		Current time in ms: the time base of the block.
+ */
+void MIDI_logBegin(MIDI_LogWriter* log, uint8_t* block, uint16_t size, uint32_t time);
+
+/* MIDI_logWrite
+ * @brief 	Appends an event to the block. Events must come in time order.
+ * @param	log			The writer.
+ * @param	event		The event to record.
+ * @return	1 if the event was recorded (or skipped, for SysEx and undefined status bytes),
+ * 			0 if the block is full: end it and start a new one.
+ */
+uint8_t MIDI_logWrite(MIDI_LogWriter* log, const MIDI_LogEvent* event);
+
+/* MIDI_logEnd
+ * @brief 	Completes the block header. The block is ready to be written to flash.
+ * @param	log			The writer.
+ * @return	The number of bytes used in the block.
+ */
+uint16_t MIDI_logEnd(MIDI_LogWriter* log);
+
+/* MIDI_logOpen
+ * @brief 	Starts decoding a block.
+ * @param	log			The reader.
+ * @param	block		The block.
+ * @param	size		Size of the block.
+ * @return	1 if the block has a valid header, 0 if it's empty (erased) or not a log block.
+ */
+uint8_t MIDI_logOpen(MIDI_LogReader* log, const uint8_t* block, uint16_t size);
+
+/* MIDI_logRead
+ * @brief 	Decodes the next event of the block.
+ * @param	log			The reader.
+ * @param	event		Where to store the event.
+ * @return	1 if an event was decoded, 0 at the end of the block (log->error is set if it was damaged).
+ */
+uint8_t MIDI_logRead(MIDI_LogReader* log, MIDI_LogEvent* event);
+
+/* MIDI_smfBegin
+ * @brief 	Starts a Standard MIDI File: header chunk and the start of its only track.
+ * @param	smf			The writer.
+ * @param	file		The file buffer; it must stay valid until MIDI_smfEnd.
+ * @param	size		Size of the buffer, at least MIDI_SMF_MIN_SIZE bytes.
+ * @param	time		Time in ms the file starts at (that of the first event, usually).
+ */
+void MIDI_smfBegin(MIDI_SMFWriter* smf, uint8_t* file, uint32_t size, uint32_t time);
+
+/* MIDI_smfWrite
+ * @brief 	Appends an event to the track. Events must come in time order.
+ * @param	smf			The writer.
+ * @param	event		The event, as decoded by MIDI_logRead.
+ * @return	1 if the event was added (or skipped, for SysEx and undefined status bytes), 0 if the
+ * 			buffer is full.
+ */
+uint8_t MIDI_smfWrite(MIDI_SMFWriter* smf, const MIDI_LogEvent* event);
+
+/* MIDI_smfEnd
+ * @brief 	Ends the track and completes its length. There is always room left for this.
+ * @param	smf			The writer.
+ * @return	The size of the file.
+ */
+uint32_t MIDI_smfEnd(MIDI_SMFWriter* smf);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* INC_MIDI_LOG_H_ */